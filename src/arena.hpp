@@ -0,0 +1,159 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <vector>
+
+// Monotonic arena: allocations bump a pointer through a list of chunks and
+// are only freed all at once by reset. After a reset the memory is kept as
+// a single chunk as large as everything allocated before, so a workload
+// which repeats the same allocations stops calling the heap after one round.
+class monotonic_arena
+{
+public:
+    explicit monotonic_arena(size_t initial_size = 1 << 16)
+        : m_initial_size(initial_size), m_chunk(0), m_offset(0)
+    {
+    }
+
+    monotonic_arena(const monotonic_arena &) = delete;
+    monotonic_arena & operator=(const monotonic_arena &) = delete;
+
+    void * allocate(size_t bytes, size_t alignment)
+    {
+        for (; m_chunk < m_chunks.size(); ++m_chunk, m_offset = 0)
+        {
+            void * result = place(bytes, alignment);
+
+            if (result != nullptr)
+            {
+                return result;
+            }
+        }
+
+        size_t size = m_chunks.empty() ? m_initial_size : 2 * m_chunks.back().size;
+
+        m_chunks.push_back(chunk(std::max(size, bytes + alignment)));
+        m_chunk = m_chunks.size() - 1;
+        m_offset = 0;
+
+        return place(bytes, alignment);
+    }
+
+    void reset()
+    {
+        if (m_chunks.size() > 1)
+        {
+            size_t total = 0;
+
+            for (auto & current : m_chunks)
+            {
+                total += current.size;
+            }
+
+            m_chunks.clear();
+            m_chunks.push_back(chunk(total));
+        }
+
+        m_chunk = 0;
+        m_offset = 0;
+    }
+
+    // Bytes held by the arena
+    size_t capacity() const
+    {
+        size_t result = 0;
+
+        for (auto & current : m_chunks)
+        {
+            result += current.size;
+        }
+
+        return result;
+    }
+
+private:
+    struct chunk
+    {
+        explicit chunk(size_t size_)
+            : memory(new char[size_]), size(size_)
+        {
+        }
+
+        std::unique_ptr<char[]> memory;
+        size_t size;
+    };
+
+    void * place(size_t bytes, size_t alignment)
+    {
+        auto & current = m_chunks[m_chunk];
+
+        std::uintptr_t base = reinterpret_cast<std::uintptr_t>(current.memory.get());
+        std::uintptr_t address = (base + m_offset + alignment - 1) & ~std::uintptr_t(alignment - 1);
+
+        if (address + bytes > base + current.size)
+        {
+            return nullptr;
+        }
+
+        m_offset = address + bytes - base;
+
+        return reinterpret_cast<void *>(address);
+    }
+
+private:
+    const size_t m_initial_size;
+    std::vector<chunk> m_chunks;
+    size_t m_chunk;
+    size_t m_offset;
+};
+
+// Standard allocator drawing from a monotonic_arena; deallocate is a no-op
+template <typename T>
+struct arena_allocator
+{
+    using value_type = T;
+
+    template <typename U>
+    struct rebind
+    {
+        using other = arena_allocator<U>;
+    };
+
+    explicit arena_allocator(monotonic_arena * arena_)
+        : arena(arena_)
+    {
+    }
+
+    template <typename U>
+    arena_allocator(const arena_allocator<U> & other)
+        : arena(other.arena)
+    {
+    }
+
+    T * allocate(size_t count)
+    {
+        return static_cast<T *>(arena->allocate(count * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T *, size_t)
+    {
+    }
+
+    monotonic_arena * arena;
+};
+
+template <typename T, typename U>
+bool operator==(const arena_allocator<T> & a, const arena_allocator<U> & b)
+{
+    return a.arena == b.arena;
+}
+
+template <typename T, typename U>
+bool operator!=(const arena_allocator<T> & a, const arena_allocator<U> & b)
+{
+    return a.arena != b.arena;
+}
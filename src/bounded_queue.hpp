@@ -0,0 +1,123 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+
+// Bounded lock-free queue for any number of producers and consumers
+// (D. Vyukov's array queue). Every cell carries a sequence number telling
+// whether it is free for the push of a given position or holds the value
+// for the pop of that position, so a push and a pop only contend on the
+// position counter of their own side.
+template <typename T>
+class bounded_queue
+{
+public:
+    explicit bounded_queue(size_t capacity)
+        : m_mask(0), m_push(0), m_pop(0)
+    {
+        size_t size = 2;
+
+        while (size < capacity)
+        {
+            size <<= 1;
+        }
+
+        m_mask = size - 1;
+        m_cells.reset(new cell[size]);
+
+        for (size_t i = 0; i < size; ++i)
+        {
+            m_cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    bounded_queue(const bounded_queue &) = delete;
+    bounded_queue & operator=(const bounded_queue &) = delete;
+
+    size_t capacity() const
+    {
+        return m_mask + 1;
+    }
+
+    // false when the queue is full
+    bool try_push(const T & value)
+    {
+        size_t position = m_push.load(std::memory_order_relaxed);
+
+        for (;;)
+        {
+            cell & target = m_cells[position & m_mask];
+            size_t sequence = target.sequence.load(std::memory_order_acquire);
+            auto difference = std::ptrdiff_t(sequence) - std::ptrdiff_t(position);
+
+            if (difference == 0)
+            {
+                if (m_push.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                {
+                    target.value = value;
+                    target.sequence.store(position + 1, std::memory_order_release);
+
+                    return true;
+                }
+            }
+            else if (difference < 0)
+            {
+                return false;
+            }
+            else
+            {
+                position = m_push.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // false when the queue is empty
+    bool try_pop(T & value)
+    {
+        size_t position = m_pop.load(std::memory_order_relaxed);
+
+        for (;;)
+        {
+            cell & target = m_cells[position & m_mask];
+            size_t sequence = target.sequence.load(std::memory_order_acquire);
+            auto difference = std::ptrdiff_t(sequence) - std::ptrdiff_t(position + 1);
+
+            if (difference == 0)
+            {
+                if (m_pop.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                {
+                    value = target.value;
+                    target.sequence.store(position + m_mask + 1, std::memory_order_release);
+
+                    return true;
+                }
+            }
+            else if (difference < 0)
+            {
+                return false;
+            }
+            else
+            {
+                position = m_pop.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+private:
+    struct cell
+    {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    std::unique_ptr<cell[]> m_cells;
+    size_t m_mask;
+
+    // The counters sit on separate cache lines, so producers and consumers
+    // do not invalidate each other's line
+    char m_push_padding[64];
+    std::atomic<size_t> m_push;
+    char m_pop_padding[64];
+    std::atomic<size_t> m_pop;
+};
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "dynamic_graph.hpp"
+
+// DynamicGraph whose AddEdge and RemoveEdge may be called from any number of
+// threads at once. The sketches are linear, so updates commute: every
+// counter is updated with an atomic add (a compare-and-swap loop for the
+// counters kept modulo p) and no update is lost, whatever the interleaving.
+// Queries must not run concurrently with updates.
+class ConcurrentDynamicGraph
+{
+public:
+    explicit ConcurrentDynamicGraph(int64_t vertex_count)
+        : m_graph(vertex_count)
+    {
+    }
+
+    int64_t VertexCount() const
+    {
+        return m_graph.VertexCount();
+    }
+
+    void SetThreadCount(size_t thread_count)
+    {
+        m_graph.SetThreadCount(thread_count);
+    }
+
+    void AddEdge(int64_t u, int64_t v)
+    {
+        update_edge(u, v, +1);
+    }
+
+    void RemoveEdge(int64_t u, int64_t v)
+    {
+        update_edge(u, v, -1);
+    }
+
+    void ApplyUpdates(const std::vector<EdgeUpdate> & updates)
+    {
+        for (auto & update : updates)
+        {
+            update_edge(update.u, update.v, update.delta);
+        }
+    }
+
+    int64_t GetComponentsNumber() const
+    {
+        return m_graph.GetComponentsNumber();
+    }
+
+    std::vector<int64_t> GetComponentLabels() const
+    {
+        return m_graph.GetComponentLabels();
+    }
+
+    bool Connected(int64_t u, int64_t v) const
+    {
+        return m_graph.Connected(u, v);
+    }
+
+private:
+    void update_edge(int64_t u, int64_t v, int64_t delta)
+    {
+        // Scratch of the calling thread
+        thread_local l0sample::update_plan plan;
+
+        m_graph.update_edge_atomic(u, v, delta, plan);
+    }
+
+private:
+    DynamicGraph m_graph;
+};
@@ -1,3 +1,5 @@
+#pragma once
+
 #include <cstdint>
 #include <vector>
 #include <utility>
@@ -6,34 +8,75 @@
 #include <tuple>
 #include <map>
 #include <algorithm>
-
-std::random_device rd;
-
-std::mt19937 mt(rd());
+#include <memory>
+#include <cstddef>
+#include <mutex>
+#include <cstdlib>
+#include <new>
+#include <functional>
+#include <fstream>
+#include <string>
+#include <stdexcept>
+#include <cstring>
+#include <cstdio>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "modular.hpp"
+#include "thread_pool.hpp"
+#include "arena.hpp"
 
 namespace prime {
 
+    // 2^b + power_offsets[b] is the least prime above 2^b
+    const int64_t power_offsets[] =
+    {
+        1, 1, 1, 3, 1, 5, 3, 3, 1, 9, 7, 5, 3, 17, 27, 3,
+        1, 29, 3, 21, 7, 17, 15, 9, 43, 35, 15, 29, 3, 11, 3, 11,
+        15, 17, 25, 53, 31, 9, 7, 23, 15, 27, 15, 29, 7, 59, 15, 5,
+        21, 69, 55, 21, 21, 5, 159, 3, 81, 9, 69, 131, 33, 15, 135
+    };
+
+    // Deterministic Miller-Rabin: no 64-bit composite is a strong
+    // pseudoprime to all of the first twelve primes
     bool is_prime(int64_t value)
     {
-        if (value == 2)
+        static const int64_t bases[] = { 2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37 };
+
+        if (value < 2)
         {
-            return true;
+            return false;
         }
 
-        if (value % 2 == 0)
+        for (auto base : bases)
         {
-            return false;
+            if (value % base == 0)
+            {
+                return value == base;
+            }
         }
 
-        int64_t step = 3;
-        while (step * step <= value)
+        uint64_t odd = uint64_t(value) - 1;
+        int64_t shift = __builtin_ctzll(odd);
+
+        odd >>= shift;
+
+        for (auto base : bases)
         {
-            if (value % step == 0)
+            uint64_t power = modular::pow_mod(uint64_t(base), odd, uint64_t(value));
+
+            for (int64_t i = 1; i < shift && power != 1 && power != uint64_t(value) - 1; ++i)
             {
-                return false;
+                power = modular::mul_mod(power, power, uint64_t(value));
             }
 
-            step += 2;
+            if (power != 1 && power != uint64_t(value) - 1)
+            {
+                return false;
+            }
         }
 
         return true;
@@ -48,22 +91,34 @@ namespace prime {
 
         return value;
     }
+
+    // Least prime above the least power of two not below value, for
+    // 0 < value <= 2^62: any prime above value will do, with no search
+    int64_t prime_above_power(int64_t value)
+    {
+        int64_t bits = value <= 1 ? 0 : 64 - __builtin_clzll(uint64_t(value) - 1);
+
+        return (int64_t(1) << bits) + power_offsets[bits];
+    }
 }
 
 namespace l0sample {
 
     std::map<int64_t, int64_t> cache_prime;
+    std::mutex cache_prime_mutex;
 
     int64_t prime_more_than(int64_t value)
     {
+        std::lock_guard<std::mutex> lock(cache_prime_mutex);
+
         auto search = cache_prime.find(value);
 
         if (search == cache_prime.end())
         {
-            cache_prime[value] = prime::prime_more_than(4 * value);
+            search = cache_prime.emplace(value, prime::prime_more_than(4 * value)).first;
         }
 
-        return cache_prime[value];
+        return search->second;
     }
 
     int64_t fast_pow(int64_t value, int64_t p_value, int64_t mod)
@@ -83,18 +138,85 @@ namespace l0sample {
         return mult * fast_pow((value * value) % mod, p_value / 2, mod);
     }
 
+    // SplitMix64: a generator whose whole state is one counter, so it is
+    // cheap to seed one per task, and value i is a function of seed and i only
+    struct split_mix
+    {
+        using result_type = uint64_t;
+
+        explicit split_mix(uint64_t seed)
+            : state(seed)
+        {
+        }
+
+        static constexpr result_type min()
+        {
+            return 0;
+        }
+
+        static constexpr result_type max()
+        {
+            return UINT64_MAX;
+        }
+
+        result_type operator()()
+        {
+            uint64_t result = (state += 0x9e3779b97f4a7c15ull);
+            result = (result ^ (result >> 30)) * 0xbf58476d1ce4e5b9ull;
+            result = (result ^ (result >> 27)) * 0x94d049bb133111ebull;
+
+            return result ^ (result >> 31);
+        }
+
+        uint64_t state;
+    };
+
+    // Seed of an object built without one: differs from run to run
+    inline uint64_t random_seed()
+    {
+        std::random_device device;
+
+        return (uint64_t(device()) << 32) | device();
+    }
+
+    // Seed of stream number `stream` of a seed. Streams are independent, so
+    // every part of a graph derives its randomness on its own, in any order
+    // and on any thread.
+    inline uint64_t derive_seed(uint64_t seed, uint64_t stream)
+    {
+        return split_mix(seed ^ split_mix(stream)())();
+    }
+
+    // Source of the random values of a schema: draw(bound) is uniform in
+    // [0, bound). Schemas draw their values in a fixed order, which their
+    // for_each_draw lists again, so a snapshot can save the values and
+    // replay them into new schemas.
+    using draw_function = std::function<int64_t(int64_t bound)>;
+
+    // Draws from a SplitMix stream scaled to the bound by a multiply-high,
+    // so a seed gives the same values in every process and with every
+    // standard library
+    inline draw_function seeded_draw(uint64_t seed)
+    {
+        split_mix generator(seed);
+
+        return [generator](int64_t bound) mutable
+        {
+            return int64_t((modular::uint128_t(generator()) * uint64_t(bound)) >> 64);
+        };
+    }
+
     class hash_k
     {
     public:
-        explicit hash_k(int64_t dom, int64_t k_value = 2)
+        explicit hash_k(int64_t dom, int64_t k_value = 2,
+                        const draw_function & draw = seeded_draw(random_seed()))
             : m_dom(dom),
-            m_prime_value(prime::prime_more_than(2 * dom))
+            m_prime_value(prime::prime_above_power(2 * dom))
         {
-            std::uniform_int_distribution<int64_t> rand_int64_t(0, m_prime_value - 1);
-
             for (auto i = 0u; i < k_value; ++i)
             {
-                m_coefficients.push_back(rand_int64_t(mt));
+                m_coefficients.push_back(draw(m_prime_value));
             }
         }
 
@@ -119,564 +241,3001 @@ namespace l0sample {
             return *this;
         }
 
-        int64_t at(int64_t value)
+        int64_t at(int64_t value) const
         {
             int64_t result = 0, mult = 1;
 
+            value %= m_prime_value;
+
             for (auto el : m_coefficients)
             {
-                result = (result + mult * el) % m_prime_value;
-                mult = (mult * value) % m_prime_value;
+                result = modular::add_mod(result, modular::mul_mod(mult, el, m_prime_value),
+                                          m_prime_value);
+                mult = modular::mul_mod(mult, value, m_prime_value);
             }
 
             return result % m_dom;
         }
 
+        // visit(value, bound) for every drawn value, in the order of drawing
+        template <typename Visitor>
+        void for_each_draw(Visitor & visit) const
+        {
+            for (auto el : m_coefficients)
+            {
+                visit(el, m_prime_value);
+            }
+        }
+
     private:
         int64_t m_dom;
         int64_t m_prime_value;
         std::vector<int64_t> m_coefficients;
     };
 
-    struct one_sparse_vector
+    // Allocator returning memory aligned to `Alignment` bytes, so that sketch
+    // counters start on a cache line boundary.
+    template <typename T, std::size_t Alignment>
+    struct aligned_allocator
     {
-        explicit one_sparse_vector(int64_t size_, double delta_)
-            : size(size_), prime_value(prime_more_than(4 * size_)),
-            s_one(0), s_two(0),
-            k_value(1 - 2 * int64_t(std::ceil(std::log2(delta_))))
+        using value_type = T;
+
+        template <typename U>
+        struct rebind
         {
-            std::uniform_int_distribution<int64_t> rand_int64_t(0, prime_value - 1);
+            using other = aligned_allocator<U, Alignment>;
+        };
 
-            for (auto i = 0u; i < k_value; ++i)
-            {
-                tests.push_back(std::make_pair(0, rand_int64_t(mt)));
-            }
-        }
+        aligned_allocator() = default;
 
-        one_sparse_vector(const one_sparse_vector & other)
+        template <typename U>
+        aligned_allocator(const aligned_allocator<U, Alignment> &)
         {
-            size = other.size;
-            prime_value = other.prime_value;
-            k_value = other.k_value;
-            s_one = other.s_one;
-            s_two = other.s_two;
-            tests = other.tests;
         }
 
-        one_sparse_vector & operator=(const one_sparse_vector & other)
+        T * allocate(std::size_t count)
         {
-            size = other.size;
-            prime_value = other.prime_value;
-            k_value = other.k_value;
-            s_one = other.s_one;
-            s_two = other.s_two;
-            tests = other.tests;
+            char * raw = static_cast<char *>(
+                ::operator new(count * sizeof(T) + Alignment + sizeof(void *)));
 
-            return *this;
+            std::uintptr_t address = reinterpret_cast<std::uintptr_t>(raw + sizeof(void *));
+            address = (address + Alignment - 1) & ~std::uintptr_t(Alignment - 1);
+
+            reinterpret_cast<void **>(address)[-1] = raw;
+
+            return reinterpret_cast<T *>(address);
         }
 
-        one_sparse_vector copy()
+        void deallocate(T * pointer, std::size_t)
         {
-            one_sparse_vector result(size, 1.0);
-            result.size = size;
-            result.prime_value = prime_value;
-            result.s_one = s_one;
-            result.s_two = s_two;
-            result.k_value = k_value;
-            result.tests = {};
-            for (auto & test : tests)
-            {
-                result.tests.push_back(test);
-            }
-
-            return result;
+            ::operator delete(reinterpret_cast<void **>(pointer)[-1]);
         }
+    };
 
-        void update(int64_t index, int64_t value)
+    template <typename T, typename U, std::size_t Alignment>
+    bool operator==(const aligned_allocator<T, Alignment> &, const aligned_allocator<U, Alignment> &)
+    {
+        return true;
+    }
+
+    template <typename T, typename U, std::size_t Alignment>
+    bool operator!=(const aligned_allocator<T, Alignment> &, const aligned_allocator<U, Alignment> &)
+    {
+        return false;
+    }
+
+    constexpr std::size_t cache_line_size = 64;
+    constexpr int64_t cache_line_counters = cache_line_size / sizeof(int64_t);
+
+    using counter_vector = std::vector< int64_t, aligned_allocator<int64_t, cache_line_size> >;
+
+    int64_t align_counters(int64_t count)
+    {
+        return (count + cache_line_counters - 1) / cache_line_counters * cache_line_counters;
+    }
+
+    // Backing memory of a sketch which is not a view into a sketch_store
+    struct owned_storage
+    {
+        counter_vector counters;
+        std::shared_ptr<const void> schema;
+    };
+
+    // Source of the zeroed, cache line aligned blocks of a sketch_store.
+    // allocate may be called from several threads at once.
+    class block_allocator
+    {
+    public:
+        virtual ~block_allocator() = default;
+
+        virtual int64_t * allocate(int64_t counters) = 0;
+        virtual void release(int64_t * block, int64_t counters) = 0;
+    };
+
+    // Every block is its own calloc allocation: large blocks come as fresh
+    // zero pages, so only the pages an update writes to become resident
+    class heap_block_allocator : public block_allocator
+    {
+    public:
+        int64_t * allocate(int64_t counters) override
         {
-            s_one += value;
-            s_two += index * value;
+            char * raw = static_cast<char *>(
+                std::calloc(counters * sizeof(int64_t) + cache_line_size + sizeof(void *), 1));
 
-            for (auto & test : tests)
+            if (raw == nullptr)
             {
-                test.first += (value * fast_pow(test.second, index, prime_value)) % prime_value;
+                throw std::bad_alloc();
             }
+
+            std::uintptr_t address = reinterpret_cast<std::uintptr_t>(raw + sizeof(void *));
+            address = (address + cache_line_size - 1) & ~std::uintptr_t(cache_line_size - 1);
+
+            reinterpret_cast<void **>(address)[-1] = raw;
+
+            return reinterpret_cast<int64_t *>(address);
         }
 
-        std::pair<int64_t, int64_t> recover()
+        void release(int64_t * block, int64_t) override
         {
-            return std::make_pair(s_two / s_one, s_one);
+            std::free(reinterpret_cast<void **>(block)[-1]);
         }
+    };
 
-        bool correct()
+    // Monotonic arena of blocks: blocks are carved out of chunks of
+    // chunk_blocks blocks and are only freed with the allocator, so a
+    // long-running graph does not fragment the heap
+    class arena_block_allocator : public block_allocator
+    {
+    public:
+        explicit arena_block_allocator(int64_t chunk_blocks = 16)
+            : m_chunk_blocks(chunk_blocks), m_next(nullptr), m_free(0)
         {
-            if (s_one == 0 || s_two % s_one != 0 || s_two * s_one < 0)
-                return false;
-
-            auto data = recover();
+        }
 
-            for (auto & test : tests)
+        ~arena_block_allocator()
+        {
+            for (auto chunk : m_chunks)
             {
-                if ((data.second * fast_pow(test.second, data.first, prime_value)
-                    - test.first) % prime_value != 0)
-                {
-                    return false;
-                }
+                m_heap.release(chunk, 0);
             }
-
-            return true;
         }
 
-        one_sparse_vector operator+(const one_sparse_vector & other)
+        int64_t * allocate(int64_t counters) override
         {
-            one_sparse_vector result = copy();
-            result.s_one = s_one + other.s_one;
-            result.s_two = s_two + other.s_two;
-            result.tests = {};
-            
-            for (int64_t i = 0; i < other.k_value; ++i)
-            {
-                int64_t first = (tests[i].first + other.tests[i].first) % other.prime_value;
-                int64_t second = other.tests[i].second;
+            int64_t size = align_counters(counters);
+            std::lock_guard<std::mutex> lock(m_mutex);
 
-                result.tests.push_back(std::make_pair(first, second));
+            if (m_free < size)
+            {
+                m_chunks.push_back(m_heap.allocate(size * m_chunk_blocks));
+                m_next = m_chunks.back();
+                m_free = size * m_chunk_blocks;
             }
 
+            int64_t * result = m_next;
+
+            m_next += size;
+            m_free -= size;
+
             return result;
         }
 
-        int64_t size;
-        int64_t prime_value;
-        int64_t s_one;
-        int64_t s_two;
-        int64_t k_value;
-        std::vector< std::pair<int64_t, int64_t> > tests;
+        void release(int64_t *, int64_t) override
+        {
+        }
+
+    private:
+        const int64_t m_chunk_blocks;
+        heap_block_allocator m_heap;
+
+        std::mutex m_mutex;
+        std::vector<int64_t *> m_chunks;
+        int64_t * m_next;
+        int64_t m_free;
     };
 
-    struct s_sparse_vector
+    // Owns a private writable mapping of a snapshot file, whose blocks a
+    // sketch_store adopts: writes copy the touched pages and never reach the
+    // file. Blocks allocated later come from the heap.
+    class mapped_block_allocator : public block_allocator
     {
-        explicit s_sparse_vector(int64_t size_, int64_t s_value_, double delta_)
-            : cnt(0), size(size_), s_value(s_value_),
-            k_value(1 - 2 * int64_t(std::ceil(std::log2(delta_ / 2.))))
+    public:
+        mapped_block_allocator(char * base, size_t size)
+            : m_base(base), m_size(size)
         {
-            double delta_decoder = delta_ / (2. * k_value * s_value);
-
-            for (auto i = 0; i < k_value; ++i)
-            {
-                sketchs.push_back({});
-                
-                for (auto j = 0; j < 2 * s_value; ++j)
-                {
-                    sketchs.back().push_back(one_sparse_vector(size, delta_decoder));
-                }
-
-                hashes.push_back(hash_k(2 * s_value));
-            }
         }
 
-        s_sparse_vector(const s_sparse_vector & other)
+        ~mapped_block_allocator()
         {
-            size = other.size;
-            s_value = other.s_value;
-            cnt = other.cnt;
-            k_value = other.k_value;
-            sketchs = other.sketchs;
-            hashes = other.hashes;
+            ::munmap(m_base, m_size);
         }
 
-        s_sparse_vector & operator=(const s_sparse_vector & other)
+        char * base() const
         {
-            size = other.size;
-            s_value = other.s_value;
-            cnt = other.cnt;
-            k_value = other.k_value;
-            sketchs = other.sketchs;
-            hashes = other.hashes;
+            return m_base;
+        }
 
-            return *this;
+        int64_t * allocate(int64_t counters) override
+        {
+            return m_heap.allocate(counters);
         }
 
-        s_sparse_vector copy()
+        void release(int64_t * block, int64_t counters) override
         {
-            s_sparse_vector result(size, 1, 1.0);
-            result.cnt = cnt;
-            result.size = size;
-            result.s_value = s_value;
-            result.k_value = k_value;
-            result.sketchs = {};
+            char * address = reinterpret_cast<char *>(block);
 
-            for (int64_t i = 0; i < k_value; ++i)
+            if (address < m_base || address >= m_base + m_size)
             {
-                result.sketchs.push_back({});
-                
-                for (auto j = 0; j < 2 * s_value; ++j)
-                {
-                    result.sketchs.back().push_back(sketchs[i][j].copy());
-                }
+                m_heap.release(block, counters);
             }
+        }
 
-            result.hashes = hashes;
+    private:
+        char * m_base;
+        size_t m_size;
+        heap_block_allocator m_heap;
+    };
 
-            return result;
+    // Storage for the counters of many sketches of the same shape, one block
+    // per sketch. Blocks are taken from the allocator on their first write:
+    // until then a block reads as the shared zero block, which is the state
+    // of a sketch without updates. Every block starts on a cache line boundary.
+    class sketch_store
+    {
+    public:
+        sketch_store()
+            : m_block_size(0)
+        {
         }
 
-        void update(int64_t index, int64_t value)
+        explicit sketch_store(int64_t block_count, int64_t block_size,
+                              std::shared_ptr<block_allocator> allocator = nullptr)
+            : m_block_size(align_counters(block_size)),
+            m_zero(m_block_size, 0), m_blocks(block_count, nullptr),
+            m_allocator(allocator ? allocator : std::make_shared<heap_block_allocator>())
         {
-            ++cnt;
-
-            for (int64_t i = 0; i < k_value; ++i)
-            {
-                sketchs[i][hashes[i].at(index)].update(index, value);
-            }
         }
 
-        std::vector< std::pair<int64_t, int64_t> > recover()
+        sketch_store(sketch_store && other)
+            : sketch_store()
         {
-            std::map<int64_t, int64_t> tmp_r;
-            std::vector< std::pair<int64_t, int64_t> > result;
-
-            for (auto & table : sketchs)
-            {
-                for (auto & cell : table)
-                {
-                    if (cell.correct())
-                    {
-                        auto pair = cell.recover();
-
-                        if (tmp_r.find(pair.first) == tmp_r.end())
-                        {
-                            result.push_back(pair);
-                        }
+            swap(other);
+        }
 
-                        tmp_r[pair.first] = pair.second;
-                    }
-                }
-            }
+        sketch_store & operator=(sketch_store && other)
+        {
+            sketch_store moved(std::move(other));
+            swap(moved);
 
-            return result;
+            return *this;
         }
 
-        s_sparse_vector operator+(const s_sparse_vector & other)
+        sketch_store(const sketch_store &) = delete;
+        sketch_store & operator=(const sketch_store &) = delete;
+
+        ~sketch_store()
         {
-            s_sparse_vector result = copy();
-            result.cnt += other.cnt;
-            result.sketchs = {};
-            
-            for (int64_t i = 0; i < k_value; ++i)
+            for (auto block : m_blocks)
             {
-                result.sketchs.push_back({});
-                
-                for (auto j = 0; j < 2 * s_value; ++j)
+                if (block != nullptr)
                 {
-                    result.sketchs.back().push_back(sketchs[i][j] + other.sketchs[i][j]);
+                    m_allocator->release(block, m_block_size);
                 }
             }
-
-            return result;
         }
 
-        bool touched()
+        void swap(sketch_store & other)
         {
-            return cnt != 0;
+            std::swap(m_block_size, other.m_block_size);
+            m_zero.swap(other.m_zero);
+            m_blocks.swap(other.m_blocks);
+            m_allocator.swap(other.m_allocator);
         }
 
-        int64_t cnt;
-        int64_t size;
-        int64_t s_value;
-        int64_t k_value;
-
-        std::vector< std::vector<one_sparse_vector> > sketchs;
-        std::vector< hash_k > hashes;
-    };
-
-    struct main_vector
-    {
-        main_vector()
-            : s_value(0), k_value(0), size(0)
+        // Block for writing, allocated if needed. Different threads may ask
+        // for the same block at once: one allocation wins, the others are released.
+        int64_t * block(int64_t index)
         {
+            int64_t * result = __atomic_load_n(&m_blocks[index], __ATOMIC_ACQUIRE);
+
+            return result != nullptr ? result : materialize(index);
         }
 
-        explicit main_vector(int64_t size_, double delta_)
-            : s_value(3 * (1 - int64_t(std::ceil(std::log2(delta_ / 2.))))),
-            k_value(1 + int64_t(std::ceil(std::log(size_)))),
-            size(size_), hash(hash_k(int64_t(std::pow(size_, 3)), s_value))
+        const int64_t * block(int64_t index) const
         {
-            // std::cout << "S: " << s_value << "; k: " << k_value
-            //             << "; size: " << size << "\n";
-
-            double delta_decode = delta_ / 2.;
+            const int64_t * result = __atomic_load_n(&m_blocks[index], __ATOMIC_ACQUIRE);
 
-            for (auto i = 0; i < k_value; ++i)
-            {
-                sketchs.push_back(
-                    s_sparse_vector(size, s_value, delta_decode));
-            }
+            return result != nullptr ? result : m_zero.data();
         }
 
-        main_vector(const main_vector & other)
+        bool materialized(int64_t index) const
         {
-            s_value = other.s_value;
-            k_value = other.k_value;
-            size = other.size;
-            hash = other.hash;
-            sketchs = other.sketchs;
+            return __atomic_load_n(&m_blocks[index], __ATOMIC_ACQUIRE) != nullptr;
         }
 
-        main_vector & operator=(const main_vector & other)
+        // Installs a block the allocator handed out otherwise, e.g. a block
+        // of a mapped snapshot
+        void adopt(int64_t index, int64_t * block)
         {
-            s_value = other.s_value;
-            k_value = other.k_value;
-            size = other.size;
-            hash = other.hash;
-            sketchs = other.sketchs;
+            release(index);
+            m_blocks[index] = block;
+        }
 
-            return *this;
+        // Gives the block back to the allocator: it reads as zero again
+        void release(int64_t index)
+        {
+            if (m_blocks[index] != nullptr)
+            {
+                m_allocator->release(m_blocks[index], m_block_size);
+                m_blocks[index] = nullptr;
+            }
         }
 
-        main_vector copy()
+        int64_t materialized_count() const
         {
-            main_vector result(size, 1.0);
-            result.s_value = s_value;
-            result.k_value = k_value;
-            result.size = size;
-            result.hash = hash;
-            result.sketchs = {};
+            int64_t result = 0;
 
-            for (int64_t i = 0; i < k_value; ++i)
+            for (int64_t i = 0; i < block_count(); ++i)
             {
-                result.sketchs.push_back(sketchs[i].copy());
+                result += materialized(i);
             }
 
             return result;
         }
 
-        void update(int64_t index, int64_t value)
+        int64_t block_count() const
         {
-            for (auto i = 0; i < k_value; ++i)
-            {
-                int64_t pow = int64_t(std::pow(2, i));
-                if (hash.at(index) % pow == 0)
-                {
-                    sketchs[i].update(index, value);
-                }
-            }
+            return int64_t(m_blocks.size());
         }
 
-        std::pair<int64_t, int64_t> sample()
+        int64_t block_size() const
         {
-            for (int64_t i = 0; i < k_value; ++i)
-            {
-                auto result = sketchs[k_value - 1 - i].recover();
-
-                if (!result.empty())
-                {
-                    std::uniform_int_distribution<int64_t> rand_int64_t(0, result.size() - 1);
-
-                    return result[rand_int64_t(mt)];
-                }
-            }
-
-            return std::make_pair(0, 0);
+            return m_block_size;
         }
 
-        main_vector operator+(const main_vector & other)
+    private:
+        int64_t * materialize(int64_t index)
         {
-            main_vector result = copy();
-            result.sketchs = {};
+            int64_t * result = m_allocator->allocate(m_block_size);
+            int64_t * expected = nullptr;
 
-            for (int64_t i = 0; i < k_value; ++i)
+            if (!__atomic_compare_exchange_n(&m_blocks[index], &expected, result,
+                                             false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
             {
-                result.sketchs.push_back(sketchs[i] + other.sketchs[i]);
+                m_allocator->release(result, m_block_size);
+                result = expected;
             }
 
             return result;
         }
 
-        int64_t s_value;
-        int64_t k_value;
-        int64_t size;
-        hash_k hash;
-        std::vector< s_sparse_vector > sketchs;
+    private:
+        int64_t m_block_size;
+        counter_vector m_zero;
+        std::vector<int64_t *> m_blocks;
+        std::shared_ptr<block_allocator> m_allocator;
     };
-}
 
-class dsu
-{
-public:
-    explicit dsu(int64_t vertex_count)
-        : m_vertex_count(vertex_count)
+    // One-sparse recovery cell. It is a view on counters laid out as
+    // [s_one, s_two, fingerprint_0, ..., fingerprint_{k-1}], where fingerprint_t
+    // is sum(value * z_t^index) mod prime_value for the k points z_t of `powers`.
+    struct one_sparse_vector
     {
-        for (int64_t i = 0; i < m_vertex_count; ++i)
+        explicit one_sparse_vector(int64_t size_, double delta_,
+                                   const draw_function & draw = seeded_draw(random_seed()))
+            : size(size_), prime_value(prime_more_than(4 * size_)),
+            k_value(1 - 2 * int64_t(std::ceil(std::log2(delta_)))),
+            owner(std::make_shared<owned_storage>())
         {
-            m_rank.push_back(0);
-            m_parent.push_back(i);
+            std::vector<int64_t> points;
+
+            for (auto i = 0u; i < k_value; ++i)
+            {
+                points.push_back(draw(prime_value));
+            }
+
+            auto own_powers = std::make_shared<modular::power_table>(prime_value, points);
+
+            owner->schema = own_powers;
+            owner->counters.assign(counter_count(k_value), 0);
+
+            powers = own_powers.get();
+            counters = owner->counters.data();
         }
-    }
 
-    int64_t find(int64_t u)
-    {
-        if (m_parent.at(u) == u)
+        one_sparse_vector(int64_t size_, int64_t prime_value_, int64_t k_value_,
+                          const modular::power_table * powers_, int64_t * counters_)
+            : size(size_), prime_value(prime_value_), k_value(k_value_),
+            powers(powers_), counters(counters_)
         {
-            return u;
         }
 
-        m_parent[u] = find(m_parent.at(u));
-
-        return m_parent.at(u);
-    }
+        static int64_t counter_count(int64_t k_value_)
+        {
+            return 2 + k_value_;
+        }
 
-    void union_(int64_t u, int64_t v)
-    {
-        u = find(u);
-        v = find(v);
+        int64_t & s_one() const
+        {
+            return counters[0];
+        }
 
-        if (m_rank.at(u) > m_rank.at(v))
+        int64_t & s_two() const
         {
-            std::swap(u, v);
+            return counters[1];
         }
 
-        if (m_rank.at(u) == m_rank.at(v))
+        int64_t * fingerprints() const
         {
-            ++m_rank[v];
+            return counters + 2;
+        }
+
+        one_sparse_vector copy() const
+        {
+            one_sparse_vector result(*this);
+            result.owner = std::make_shared<owned_storage>();
+            result.owner->schema = owner ? owner->schema : nullptr;
+            result.owner->counters.assign(counters, counters + counter_count(k_value));
+            result.counters = result.owner->counters.data();
+
+            return result;
+        }
+
+        void update(int64_t index, int64_t value)
+        {
+            s_one() += value;
+            s_two() += index * value;
+
+            uint64_t scale = modular::reduce(value, prime_value);
+
+            for (int64_t i = 0; i < k_value; ++i)
+            {
+                fingerprints()[i] = modular::add_mod(fingerprints()[i],
+                    powers->scaled_power(i, index, scale), prime_value);
+            }
+        }
+
+        std::pair<int64_t, int64_t> recover() const
+        {
+            return std::make_pair(s_two() / s_one(), s_one());
+        }
+
+        bool correct() const
+        {
+            if (s_one() == 0 || s_two() % s_one() != 0 || s_two() * s_one() < 0)
+                return false;
+
+            auto data = recover();
+            uint64_t scale = modular::reduce(data.second, prime_value);
+
+            for (int64_t i = 0; i < k_value; ++i)
+            {
+                if (powers->scaled_power(i, data.first, scale) != uint64_t(fingerprints()[i]))
+                {
+                    return false;
+                }
+            }
+
+            return true;
+        }
+
+        one_sparse_vector & operator+=(const one_sparse_vector & other)
+        {
+            s_one() += other.s_one();
+            s_two() += other.s_two();
+
+            for (int64_t i = 0; i < k_value; ++i)
+            {
+                fingerprints()[i] = modular::add_mod(fingerprints()[i],
+                    other.fingerprints()[i], prime_value);
+            }
+
+            return *this;
+        }
+
+        one_sparse_vector operator+(const one_sparse_vector & other) const
+        {
+            one_sparse_vector result = copy();
+            result += other;
+
+            return result;
+        }
+
+        int64_t size;
+        int64_t prime_value;
+        int64_t k_value;
+        const modular::power_table * powers;
+        int64_t * counters;
+        std::shared_ptr<owned_storage> owner;
+    };
+
+    // Loops over the counters of one s-sparse structure, laid out as
+    // [cnt, rows * cells one-sparse cells of 2 + tests counters]. Rows and
+    // Tests fix the shape at compile time, so the row loop is unrolled and
+    // the cell offsets are constants; 0 leaves the dimension to runtime.
+    // Fingerprints go through the vector add_mod kernels either way.
+    template <int64_t Rows, int64_t Tests>
+    struct level_loops
+    {
+        static void apply(int64_t * counters, int64_t rows, int64_t cells, int64_t tests,
+                          const int64_t * buckets, const uint64_t * terms,
+                          int64_t index, int64_t value, uint64_t prime_value)
+        {
+            rows = Rows != 0 ? Rows : rows;
+            tests = Tests != 0 ? Tests : tests;
+
+            ++counters[0];
+
+            for (int64_t i = 0; i < rows; ++i)
+            {
+                int64_t * cell = counters + 1 + (i * cells + buckets[i]) * (2 + tests);
+
+                cell[0] += value;
+                cell[1] += index * value;
+
+                modular::add_mod(cell + 2, terms, tests, prime_value);
+            }
+        }
+
+        static void merge(int64_t * counters, const int64_t * other,
+                          int64_t rows, int64_t cells, int64_t tests, uint64_t prime_value)
+        {
+            rows = Rows != 0 ? Rows : rows;
+            tests = Tests != 0 ? Tests : tests;
+
+            counters[0] += other[0];
+
+            for (int64_t i = 0; i < rows * cells; ++i)
+            {
+                int64_t * cell = counters + 1 + i * (2 + tests);
+                const int64_t * other_cell = other + 1 + i * (2 + tests);
+
+                cell[0] += other_cell[0];
+                cell[1] += other_cell[1];
+
+                modular::add_mod(cell + 2, reinterpret_cast<const uint64_t *>(other_cell + 2),
+                                 tests, prime_value);
+            }
+        }
+    };
+
+    struct level_kernels
+    {
+        void (*apply)(int64_t * counters, int64_t rows, int64_t cells, int64_t tests,
+                      const int64_t * buckets, const uint64_t * terms,
+                      int64_t index, int64_t value, uint64_t prime_value);
+        void (*merge)(int64_t * counters, const int64_t * other,
+                      int64_t rows, int64_t cells, int64_t tests, uint64_t prime_value);
+    };
+
+    // Shape of the s-sparse structures of a sketch built with delta = 1 / DeltaInverse,
+    // the integer form of the sketch_schema and s_sparse_schema formulas
+    template <int64_t DeltaInverse>
+    struct fixed_parameters
+    {
+        static constexpr int64_t floor_log2(int64_t value)
+        {
+            int64_t result = 0;
+
+            while (value > 1)
+            {
+                value >>= 1;
+                ++result;
+            }
+
+            return result;
+        }
+
+        static constexpr int64_t s_value = 3 * (1 + floor_log2(2 * DeltaInverse));
+        static constexpr int64_t row_count = 1 + 2 * floor_log2(4 * DeltaInverse);
+        static constexpr int64_t test_count =
+            1 + 2 * floor_log2(4 * DeltaInverse * row_count * s_value);
+
+        static constexpr level_kernels kernels()
+        {
+            return level_kernels{ level_loops<row_count, test_count>::apply,
+                                  level_loops<row_count, test_count>::merge };
+        }
+    };
+
+    // Specialized loops when the shape is one of the common configurations,
+    // the runtime-sized ones otherwise
+    inline level_kernels select_level_kernels(int64_t rows, int64_t tests)
+    {
+        struct entry
+        {
+            int64_t rows;
+            int64_t tests;
+            level_kernels kernels;
+        };
+
+        static const entry fixed[] =
+        {
+            { fixed_parameters<10>::row_count, fixed_parameters<10>::test_count,
+              fixed_parameters<10>::kernels() },
+            { fixed_parameters<100>::row_count, fixed_parameters<100>::test_count,
+              fixed_parameters<100>::kernels() },
+            { fixed_parameters<1000>::row_count, fixed_parameters<1000>::test_count,
+              fixed_parameters<1000>::kernels() },
+        };
+
+        for (auto & current : fixed)
+        {
+            if (current.rows == rows && current.tests == tests)
+            {
+                return current.kernels;
+            }
+        }
+
+        return level_kernels{ level_loops<0, 0>::apply, level_loops<0, 0>::merge };
+    }
+
+    // Parameters and randomness of an s-sparse structure: k_value rows of
+    // 2 * s_value one-sparse cells. All cells share the test_count evaluation
+    // points of the structure: each cell is tested independently, so the
+    // union bound over cells does not need independent points per cell.
+    // A schema is immutable and shared by every sketch built from it.
+    struct s_sparse_schema
+    {
+        explicit s_sparse_schema(int64_t size_, int64_t s_value_, double delta_,
+                                 const draw_function & draw = seeded_draw(random_seed()))
+            : size(size_), s_value(s_value_),
+            k_value(1 - 2 * int64_t(std::ceil(std::log2(delta_ / 2.))))
+        {
+            double delta_decoder = delta_ / (2. * k_value * s_value);
+
+            test_count = 1 - 2 * int64_t(std::ceil(std::log2(delta_decoder)));
+            prime_value = prime_more_than(4 * size);
+
+            for (auto i = 0; i < test_count; ++i)
+            {
+                points.push_back(draw(prime_value));
+            }
+
+            for (auto i = 0; i < k_value; ++i)
+            {
+                hashes.push_back(hash_k(2 * s_value, 2, draw));
+            }
+
+            powers = modular::power_table(prime_value, points);
+            kernels = select_level_kernels(k_value, test_count);
+        }
+
+        int64_t cell_count() const
+        {
+            return 2 * s_value;
+        }
+
+        template <typename Visitor>
+        void for_each_draw(Visitor & visit) const
+        {
+            for (auto point : points)
+            {
+                visit(point, prime_value);
+            }
+
+            for (auto & hash_ : hashes)
+            {
+                hash_.for_each_draw(visit);
+            }
+        }
+
+        // Fills the bucket of index in every row and value * z_t^index,
+        // -value * z_t^index for every evaluation point
+        void prepare(int64_t index, int64_t value,
+                     int64_t * buckets, uint64_t * terms, uint64_t * negated) const
+        {
+            for (int64_t i = 0; i < k_value; ++i)
+            {
+                buckets[i] = hashes[i].at(index);
+            }
+
+            powers.scaled_powers(index, modular::reduce(value, prime_value), 0, test_count, terms);
+
+            for (int64_t t = 0; t < test_count; ++t)
+            {
+                negated[t] = terms[t] == 0 ? 0 : prime_value - terms[t];
+            }
+        }
+
+        // Counters are laid out as [cnt, row 0 cells, ..., row k-1 cells]
+        int64_t counter_count() const
+        {
+            return 1 + k_value * cell_count() * one_sparse_vector::counter_count(test_count);
+        }
+
+        int64_t size;
+        int64_t s_value;
+        int64_t k_value;
+        int64_t test_count;
+        int64_t prime_value;
+
+        std::vector< hash_k > hashes;
+        std::vector<int64_t> points;
+        modular::power_table powers;
+        level_kernels kernels;
+    };
+
+    // Everything an update of one index needs from a sketch_schema: it is
+    // computed once and then applied to any number of sketches of the schema,
+    // with either sign. Buckets are [level][row], terms are [level][test].
+    struct update_plan
+    {
+        update_plan()
+            : index(0), value(0), level_count(0), row_count(0), test_count(0)
+        {
+        }
+
+        int64_t index;
+        int64_t value;
+        int64_t level_count;
+        int64_t row_count;
+        int64_t test_count;
+
+        std::vector<int64_t> buckets;
+        std::vector<uint64_t> terms;
+        std::vector<uint64_t> negated;
+    };
+
+    // Parameters and randomness of an l0-sampler: k_value levels of
+    // s-sparse structures whose counters are stored back to back.
+    struct sketch_schema
+    {
+        explicit sketch_schema(int64_t size_, double delta_,
+                               const draw_function & draw = seeded_draw(random_seed()))
+            : s_value(3 * (1 - int64_t(std::ceil(std::log2(delta_ / 2.))))),
+            k_value(1 + int64_t(std::ceil(std::log(size_)))),
+            size(size_), hash(hash_k(hash_domain(size_), s_value, draw))
+        {
+            // std::cout << "S: " << s_value << "; k: " << k_value
+            //             << "; size: " << size << "\n";
+
+            double delta_decode = delta_ / 2.;
+
+            for (auto i = 0; i < k_value; ++i)
+            {
+                levels.push_back(s_sparse_schema(size, s_value, delta_decode, draw));
+            }
+
+            level_size = levels.empty() ? 0 : levels.front().counter_count();
+        }
+
+        // size^3, capped at 2^60 so that the hash prime and its sums fit in 64
+        // bits: only the trailing zeros of the hash are used, and k_value
+        // stays far below 60
+        static int64_t hash_domain(int64_t size_)
+        {
+            const int64_t limit = int64_t(1) << 60;
+            int64_t result = 1;
+
+            for (auto i = 0; i < 3; ++i)
+            {
+                result = result > limit / size_ ? limit : result * size_;
+            }
+
+            return result;
+        }
+
+        int64_t counter_count() const
+        {
+            return k_value * level_size;
+        }
+
+        template <typename Visitor>
+        void for_each_draw(Visitor & visit) const
+        {
+            hash.for_each_draw(visit);
+
+            for (auto & level : levels)
+            {
+                level.for_each_draw(visit);
+            }
+        }
+
+        // Reuses the capacity of plan, so a plan kept across calls does not allocate
+        void prepare(int64_t index, int64_t value, update_plan & plan) const
+        {
+            // Level i receives the indices whose hash is divisible by 2^i
+            uint64_t hashed = uint64_t(hash.at(index));
+            int64_t depth = hashed == 0 ? k_value : int64_t(__builtin_ctzll(hashed)) + 1;
+
+            plan.index = index;
+            plan.value = value;
+            plan.level_count = std::min(k_value, depth);
+            plan.row_count = levels.empty() ? 0 : levels.front().k_value;
+            plan.test_count = levels.empty() ? 0 : levels.front().test_count;
+
+            plan.buckets.resize(plan.level_count * plan.row_count);
+            plan.terms.resize(plan.level_count * plan.test_count);
+            plan.negated.resize(plan.level_count * plan.test_count);
+
+            for (int64_t i = 0; i < plan.level_count; ++i)
+            {
+                levels[i].prepare(index, value,
+                    plan.buckets.data() + i * plan.row_count,
+                    plan.terms.data() + i * plan.test_count,
+                    plan.negated.data() + i * plan.test_count);
+            }
+        }
+
+        int64_t s_value;
+        int64_t k_value;
+        int64_t size;
+        int64_t level_size;
+        hash_k hash;
+        std::vector< s_sparse_schema > levels;
+    };
+
+    // s-sparse recovery structure: a view on the counters of one s_sparse_schema.
+    // When no external counters are given the structure allocates its own.
+    struct s_sparse_vector
+    {
+        explicit s_sparse_vector(int64_t size_, int64_t s_value_, double delta_)
+        {
+            auto own_schema = std::make_shared<s_sparse_schema>(size_, s_value_, delta_);
+
+            owner = std::make_shared<owned_storage>();
+            owner->schema = own_schema;
+            owner->counters.assign(own_schema->counter_count(), 0);
+
+            schema = own_schema.get();
+            counters = owner->counters.data();
+        }
+
+        s_sparse_vector(const s_sparse_schema & schema_, int64_t * counters_)
+            : schema(&schema_), counters(counters_)
+        {
+        }
+
+        int64_t & cnt() const
+        {
+            return counters[0];
+        }
+
+        one_sparse_vector cell(int64_t row, int64_t bucket) const
+        {
+            int64_t index = row * schema->cell_count() + bucket;
+
+            return one_sparse_vector(schema->size, schema->prime_value, schema->test_count,
+                &schema->powers,
+                counters + 1 + index * one_sparse_vector::counter_count(schema->test_count));
+        }
+
+        s_sparse_vector copy() const
+        {
+            s_sparse_vector result(*this);
+            result.owner = std::make_shared<owned_storage>();
+            result.owner->schema = owner ? owner->schema : nullptr;
+            result.owner->counters.assign(counters, counters + schema->counter_count());
+            result.counters = result.owner->counters.data();
+
+            return result;
+        }
+
+        // Adds value at index given its bucket in every row and the terms
+        // value * z_t^index prepared by the schema; the terms are the same in
+        // every row, so they are computed once and added to one cell per row
+        void apply(int64_t index, int64_t value, const int64_t * buckets, const uint64_t * terms)
+        {
+            schema->kernels.apply(counters, schema->k_value, schema->cell_count(), schema->test_count,
+                                  buckets, terms, index, value, uint64_t(schema->prime_value));
+        }
+
+        // apply for concurrent callers: every counter is updated atomically,
+        // so updates from several threads may hit the same cells
+        void apply_atomic(int64_t index, int64_t value, const int64_t * buckets, const uint64_t * terms)
+        {
+            __atomic_fetch_add(&cnt(), 1, __ATOMIC_RELAXED);
+
+            for (int64_t i = 0; i < schema->k_value; ++i)
+            {
+                auto current = cell(i, buckets[i]);
+
+                __atomic_fetch_add(&current.s_one(), value, __ATOMIC_RELAXED);
+                __atomic_fetch_add(&current.s_two(), index * value, __ATOMIC_RELAXED);
+
+                modular::atomic_add_mod(current.fingerprints(), terms, schema->test_count,
+                                        schema->prime_value);
+            }
+        }
+
+        void update(int64_t index, int64_t value)
+        {
+            std::vector<int64_t> buckets(schema->k_value);
+            std::vector<uint64_t> terms(schema->test_count);
+            std::vector<uint64_t> negated(schema->test_count);
+
+            schema->prepare(index, value, buckets.data(), terms.data(), negated.data());
+            apply(index, value, buckets.data(), terms.data());
+        }
+
+        // Writes the distinct recovered (index, value) pairs into result,
+        // reusing its capacity
+        void recover(std::vector< std::pair<int64_t, int64_t> > & result) const
+        {
+            result.clear();
+
+            for (int64_t i = 0; i < schema->k_value; ++i)
+            {
+                for (int64_t j = 0; j < schema->cell_count(); ++j)
+                {
+                    auto current = cell(i, j);
+
+                    if (current.correct())
+                    {
+                        result.push_back(current.recover());
+                    }
+                }
+            }
+
+            std::sort(result.begin(), result.end());
+
+            result.erase(std::unique(result.begin(), result.end(),
+                [](const std::pair<int64_t, int64_t> & a, const std::pair<int64_t, int64_t> & b)
+                {
+                    return a.first == b.first;
+                }), result.end());
+        }
+
+        // True when the vector is zero, up to a fingerprint collision: every
+        // index has a cell in row 0, and a cell with a nonzero sum has a
+        // nonzero counter
+        bool zero() const
+        {
+            const int64_t * first = counters + 1;
+            const int64_t * last = first
+                + schema->cell_count() * one_sparse_vector::counter_count(schema->test_count);
+
+            return std::all_of(first, last, [](int64_t counter) { return counter == 0; });
+        }
+
+        std::vector< std::pair<int64_t, int64_t> > recover() const
+        {
+            std::vector< std::pair<int64_t, int64_t> > result;
+            recover(result);
+
+            return result;
+        }
+
+        // Adds the counters of other (built from the same schema) to this one
+        s_sparse_vector & operator+=(const s_sparse_vector & other)
+        {
+            schema->kernels.merge(counters, other.counters, schema->k_value, schema->cell_count(),
+                                  schema->test_count, uint64_t(schema->prime_value));
+
+            return *this;
+        }
+
+        s_sparse_vector operator+(const s_sparse_vector & other) const
+        {
+            s_sparse_vector result = copy();
+            result += other;
+
+            return result;
+        }
+
+        bool touched() const
+        {
+            return cnt() != 0;
+        }
+
+        const s_sparse_schema * schema;
+        int64_t * counters;
+        std::shared_ptr<owned_storage> owner;
+    };
+
+    // l0-sampler: a view on the counters of one sketch_schema.
+    // When constructed from parameters it allocates its own schema and counters.
+    struct main_vector
+    {
+        main_vector()
+            : schema(nullptr), counters(nullptr)
+        {
+        }
+
+        explicit main_vector(int64_t size_, double delta_)
+        {
+            auto own_schema = std::make_shared<sketch_schema>(size_, delta_);
+
+            owner = std::make_shared<owned_storage>();
+            owner->schema = own_schema;
+            owner->counters.assign(own_schema->counter_count(), 0);
+
+            schema = own_schema.get();
+            counters = owner->counters.data();
+        }
+
+        main_vector(const sketch_schema & schema_, int64_t * counters_)
+            : schema(&schema_), counters(counters_)
+        {
+        }
+
+        s_sparse_vector level(int64_t index) const
+        {
+            return s_sparse_vector(schema->levels[index], counters + index * schema->level_size);
+        }
+
+        main_vector copy() const
+        {
+            main_vector result(*this);
+            result.owner = std::make_shared<owned_storage>();
+            result.owner->schema = owner ? owner->schema : nullptr;
+            result.owner->counters.assign(counters, counters + schema->counter_count());
+            result.counters = result.owner->counters.data();
+
+            return result;
+        }
+
+        void clear()
+        {
+            std::fill(counters, counters + schema->counter_count(), 0);
+        }
+
+        // Applies plan, or its opposite update when negate is set
+        void apply(const update_plan & plan, bool negate = false)
+        {
+            int64_t value = negate ? -plan.value : plan.value;
+            const auto & terms = negate ? plan.negated : plan.terms;
+
+            for (int64_t i = 0; i < plan.level_count; ++i)
+            {
+                level(i).apply(plan.index, value,
+                    plan.buckets.data() + i * plan.row_count,
+                    terms.data() + i * plan.test_count);
+            }
+        }
+
+        void apply_atomic(const update_plan & plan, bool negate = false)
+        {
+            int64_t value = negate ? -plan.value : plan.value;
+            const auto & terms = negate ? plan.negated : plan.terms;
+
+            for (int64_t i = 0; i < plan.level_count; ++i)
+            {
+                level(i).apply_atomic(plan.index, value,
+                    plan.buckets.data() + i * plan.row_count,
+                    terms.data() + i * plan.test_count);
+            }
+        }
+
+        void update(int64_t index, int64_t value)
+        {
+            update_plan plan;
+            schema->prepare(index, value, plan);
+            apply(plan);
+        }
+
+        // Samples with scratch as the buffer for recovered pairs, so repeated
+        // calls do not allocate, and generator as the source of randomness
+        template <typename Generator>
+        std::pair<int64_t, int64_t> sample(std::vector< std::pair<int64_t, int64_t> > & scratch,
+                                           Generator & generator) const
+        {
+            for (int64_t i = 0; i < schema->k_value; ++i)
+            {
+                level(schema->k_value - 1 - i).recover(scratch);
+
+                if (!scratch.empty())
+                {
+                    std::uniform_int_distribution<int64_t> rand_int64_t(0, scratch.size() - 1);
+
+                    return scratch[rand_int64_t(generator)];
+                }
+            }
+
+            return std::make_pair(0, 0);
+        }
+
+        std::pair<int64_t, int64_t> sample(std::vector< std::pair<int64_t, int64_t> > & scratch) const
+        {
+            split_mix generator(random_seed());
+
+            return sample(scratch, generator);
+        }
+
+        std::pair<int64_t, int64_t> sample() const
+        {
+            std::vector< std::pair<int64_t, int64_t> > scratch;
+
+            return sample(scratch);
+        }
+
+        // Level 0 holds every index
+        bool zero() const
+        {
+            return schema->k_value == 0 || level(0).zero();
+        }
+
+        main_vector & operator+=(const main_vector & other)
+        {
+            for (int64_t i = 0; i < schema->k_value; ++i)
+            {
+                level(i) += other.level(i);
+            }
+
+            return *this;
+        }
+
+        main_vector operator+(const main_vector & other) const
+        {
+            main_vector result = copy();
+            result += other;
+
+            return result;
+        }
+
+        const sketch_schema * schema;
+        int64_t * counters;
+        std::shared_ptr<owned_storage> owner;
+    };
+}
+
+// Disjoint sets of uint32_t ids: iterative find with path halving and union by size
+class dsu
+{
+public:
+    explicit dsu(int64_t vertex_count)
+        : m_parent(vertex_count), m_size(vertex_count, 1)
+    {
+        for (int64_t i = 0; i < vertex_count; ++i)
+        {
+            m_parent[i] = uint32_t(i);
+        }
+    }
+
+    uint32_t find(uint32_t u)
+    {
+        while (m_parent[u] != u)
+        {
+            m_parent[u] = m_parent[m_parent[u]];
+            u = m_parent[u];
+        }
+
+        return u;
+    }
+
+    // Returns false when u and v are already in the same set
+    bool union_(uint32_t u, uint32_t v)
+    {
+        u = find(u);
+        v = find(v);
+
+        if (u == v)
+        {
+            return false;
+        }
+
+        if (m_size[u] > m_size[v])
+        {
+            std::swap(u, v);
         }
 
         m_parent[u] = v;
+        m_size[v] += m_size[u];
+
+        return true;
+    }
+
+    uint32_t size(uint32_t u)
+    {
+        return m_size[find(u)];
+    }
+
+private:
+    std::vector<uint32_t> m_parent;
+    std::vector<uint32_t> m_size;
+};
+
+// On-disk format of DynamicGraph::Save. The file is a header, the random
+// values of the schemas, a table with the block number of every vertex
+// (-1 when its sketch is zero) and, from a page boundary on, the counter
+// blocks, each starting on a page, so a mapped file is used in place.
+// Zero pages of the blocks are left as holes: like in memory, only the
+// pages updates wrote to take space. Integers are stored in the byte order
+// of the host. Every section is checksummed; the blocks by the sum of the
+// checksums of their nonzero pages, which needs no pass over the holes.
+namespace snapshot
+{
+    constexpr char magic[8] = { 'D', 'G', 'S', 'N', 'A', 'P', 0, 0 };
+    constexpr uint32_t version = 2;
+    constexpr uint64_t page_size = 4096;
+
+    struct header
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t header_size;
+
+        int64_t vertex_count;
+        int64_t delta_inverse;
+        int64_t block_size;
+        int64_t block_count;
+        uint64_t seed;  // DynamicGraph::Seed, which the query stream derives from
+
+        uint64_t draw_count;
+        uint64_t draws_offset;
+        uint64_t table_offset;
+        uint64_t data_offset;
+        uint64_t file_size;
+
+        uint64_t meta_checksum;
+        uint64_t data_checksum;
+        uint64_t header_checksum;
+    };
+
+    // Hash of 64-bit words in four independent lanes, so it runs close to
+    // memory speed; chain calls through seed to cover several pieces
+    inline uint64_t checksum(const void * data, size_t words, uint64_t seed)
+    {
+        const uint64_t multiplier = 0x9e3779b97f4a7c15ull;
+        const uint64_t * source = static_cast<const uint64_t *>(data);
+        uint64_t lanes[4] = { seed, seed + 1, seed + 2, seed + 3 };
+
+        auto mix = [multiplier](uint64_t lane, uint64_t word)
+        {
+            lane ^= word;
+            lane = (lane << 31) | (lane >> 33);
+
+            return lane * multiplier;
+        };
+
+        // Word i goes to lane i % 4
+        for (size_t i = 0; i < words; ++i)
+        {
+            lanes[i % 4] = mix(lanes[i % 4], source[i]);
+        }
+
+        uint64_t result = words;
+
+        for (auto lane : lanes)
+        {
+            result = mix(result, lane);
+        }
+
+        return result ^ (result >> 29);
+    }
+
+    // Partial sketches of DynamicGraph::ExportSketches: the header, then for
+    // every vertex with updates its index, the number of its nonzero pages
+    // and every such page as its page number within the block followed by
+    // the page, then -1 and the checksum of all pages
+    constexpr char partial_magic[8] = { 'D', 'G', 'P', 'A', 'R', 'T', 0, 0 };
+
+    struct partial_header
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t header_size;
+
+        int64_t vertex_count;
+        int64_t delta_inverse;
+        int64_t block_size;
+        uint64_t schema_checksum;
+    };
+
+    inline uint64_t round_up(uint64_t value, uint64_t alignment)
+    {
+        return (value + alignment - 1) / alignment * alignment;
+    }
+
+    inline bool zero(const char * data, size_t size)
+    {
+        const uint64_t * words = reinterpret_cast<const uint64_t *>(data);
+        uint64_t any = 0;
+
+        for (size_t i = 0; i < size / sizeof(uint64_t); ++i)
+        {
+            any |= words[i];
+        }
+
+        return any == 0;
+    }
+
+    // Part of the block checksum of data page number `page`
+    inline uint64_t page_checksum(const char * data, uint64_t page)
+    {
+        return zero(data, page_size) ? 0 : checksum(data, page_size / sizeof(uint64_t), page);
+    }
+
+    // Makes a file, or the entries of a directory, durable
+    inline void sync_path(const std::string & path)
+    {
+        int fd = ::open(path.c_str(), O_RDONLY);
+
+        if (fd < 0 || ::fsync(fd) != 0)
+        {
+            if (fd >= 0)
+            {
+                ::close(fd);
+            }
+
+            throw std::runtime_error("cannot sync " + path);
+        }
+
+        ::close(fd);
+    }
+
+    inline std::string directory_of(const std::string & path)
+    {
+        size_t slash = path.rfind('/');
+
+        if (slash == std::string::npos)
+        {
+            return ".";
+        }
+
+        return slash == 0 ? "/" : path.substr(0, slash);
+    }
+} // snapshot
+
+constexpr int64_t delta_inverse_const = 100;
+constexpr double delta_const = 1. / delta_inverse_const;
+
+struct EdgeUpdate
+{
+    int64_t u;
+    int64_t v;
+    int64_t delta;  // +1 adds the edge, -1 removes it
+};
+
+class DynamicGraph
+{
+public:
+    // allocator provides the memory of the vertex sketches; by default every
+    // vertex block is a separate heap allocation
+    explicit DynamicGraph(int64_t vertex_count,
+                          std::shared_ptr<l0sample::block_allocator> allocator = nullptr)
+        : DynamicGraph(vertex_count, l0sample::random_seed(), std::move(allocator))
+    {
+    }
+
+    // All randomness of the graph comes from seed: graphs with the same
+    // vertex count and seed have the same schemas in any process, so their
+    // sketches can be merged, and give the same answers to the same updates
+    // and queries. Sketch i draws from stream i of the seed, queries from
+    // their own stream.
+    DynamicGraph(int64_t vertex_count, uint64_t seed,
+                 std::shared_ptr<l0sample::block_allocator> allocator = nullptr)
+        : DynamicGraph(vertex_count, seed, [seed](int64_t sketch)
+            {
+                return l0sample::seeded_draw(l0sample::derive_seed(seed, uint64_t(sketch)));
+            }, std::move(allocator))
+    {
+    }
+
+    uint64_t Seed() const
+    {
+        return m_seed;
+    }
+
+    int64_t VertexCount() const
+    {
+        return m_vertex_count;
+    }
+
+    // Runs GetComponentsNumber on thread_count threads
+    void SetThreadCount(size_t thread_count)
+    {
+        m_pool.reset(thread_count > 1 ? new thread_pool(thread_count) : nullptr);
+    }
+
+    // Sketches are allocated on the first update of their vertex. This
+    // allocates all of them up front instead, on the threads set by
+    // SetThreadCount, and writes one word of every page of the new blocks:
+    // zeroed memory gets its pages only on the first write, so the page
+    // faults are taken here, by many cores at once, and not by updates.
+    void MaterializeSketches()
+    {
+        const int64_t page_counters = 4096 / sizeof(int64_t);
+
+        auto materialize = [this, page_counters](size_t, int64_t vertex)
+        {
+            // Blocks already there may be pages of a loaded snapshot, which
+            // a write would copy
+            if (m_store.materialized(vertex))
+            {
+                return;
+            }
+
+            volatile int64_t * block = m_store.block(vertex);
+
+            for (int64_t i = 0; i < m_store.block_size(); i += page_counters)
+            {
+                block[i] = 0;
+            }
+        };
+
+        if (m_pool)
+        {
+            m_pool->parallel_for(m_vertex_count, materialize);
+        }
+        else
+        {
+            for (int64_t i = 0; i < m_vertex_count; ++i)
+            {
+                materialize(0, i);
+            }
+        }
+    }
+
+    // Number of vertices whose sketches are allocated
+    int64_t MaterializedVertexCount() const
+    {
+        return m_store.materialized_count();
+    }
+
+    void AddEdge(int64_t u, int64_t v)
+    {
+        update_edge(u, v, +1);
+    }
+
+    void RemoveEdge(int64_t u, int64_t v)
+    {
+        update_edge(u, v, -1);
+    }
+
+    void AddEdges(const std::vector< std::pair<int64_t, int64_t> > & edges)
+    {
+        std::vector<EdgeUpdate> updates;
+
+        for (auto & edge : edges)
+        {
+            updates.push_back({ edge.first, edge.second, +1 });
+        }
+
+        ApplyUpdates(updates);
+    }
+
+    void RemoveEdges(const std::vector< std::pair<int64_t, int64_t> > & edges)
+    {
+        std::vector<EdgeUpdate> updates;
+
+        for (auto & edge : edges)
+        {
+            updates.push_back({ edge.first, edge.second, -1 });
+        }
+
+        ApplyUpdates(updates);
+    }
+
+    void ApplyUpdates(const std::vector<EdgeUpdate> & updates)
+    {
+        ApplyUpdates(updates.data(), updates.size());
+    }
+
+    // Applies a batch of updates chunk by chunk. Within a chunk updates of the
+    // same edge are summed first, every edge is hashed once per sketch and the
+    // endpoints are then updated in vertex order, so each vertex block is
+    // visited once per sketch and chunk.
+    void ApplyUpdates(const EdgeUpdate * updates, size_t count)
+    {
+        for (size_t first = 0; first < count; first += batch_chunk)
+        {
+            apply_chunk(updates + first, count - first < batch_chunk ? count - first : batch_chunk);
+        }
+    }
+
+    // Keeps the components found by every query, with the sum of the
+    // sketches of each component of two or more vertices, and applies later
+    // updates to those sums too. The next query then starts Boruvka from
+    // these components: the ones no update touched are final, the ones that
+    // lost an internal edge are split back into vertices and the others
+    // start as single nodes, so its work follows the changes rather than n.
+    // Updates through ConcurrentDynamicGraph or ShardedIngestor make the
+    // next query start from scratch.
+    void SetIncrementalQueries(bool enabled)
+    {
+        std::lock_guard<std::mutex> lock(m_query_mutex);
+
+        m_incremental = enabled;
+        clear_partition();
+    }
+
+    // Keeps the exact components in a union-find next to the sketches while
+    // only edges are added, and answers queries from it. A deletion drops it
+    // until the next query, which runs on the sketches and starts it again
+    // from the components found. Updates through ConcurrentDynamicGraph or
+    // ShardedIngestor drop it as well.
+    void SetExactInserts(bool enabled)
+    {
+        std::lock_guard<std::mutex> lock(m_query_mutex);
+
+        // While no sketch holds anything every vertex is its own component;
+        // otherwise the next query starts the union-find from the sketches
+        m_exact_inserts = enabled;
+        m_exact_valid = enabled && m_store.materialized_count() == 0;
+        m_exact = dsu(enabled ? m_vertex_count : 0);
+        m_exact_count = m_vertex_count;
+    }
+
+    // Writes the sketches and the random values of their schemas to path, in
+    // the format of namespace snapshot. The file is replaced atomically, so a
+    // crash leaves the old snapshot or the new one, and path may be the file
+    // the graph was loaded from. Must not run concurrently with updates.
+    void Save(const std::string & path) const
+    {
+        std::vector<int64_t> draws;
+        auto collect = [&draws](int64_t value, int64_t) { draws.push_back(value); };
+
+        for (auto & schema : m_schema)
+        {
+            schema->for_each_draw(collect);
+        }
+
+        // Only the blocks of vertices with updates are written
+        std::vector<int64_t> table(m_vertex_count, -1);
+        int64_t block_count = 0;
+
+        for (int64_t i = 0; i < m_vertex_count; ++i)
+        {
+            if (m_store.materialized(i))
+            {
+                table[i] = block_count++;
+            }
+        }
+
+        snapshot::header head;
+
+        std::memset(&head, 0, sizeof(head));
+        std::memcpy(head.magic, snapshot::magic, sizeof(head.magic));
+
+        head.version = snapshot::version;
+        head.header_size = sizeof(head);
+        head.vertex_count = m_vertex_count;
+        head.delta_inverse = delta_inverse_const;
+        head.block_size = m_store.block_size();
+        head.block_count = block_count;
+        head.seed = m_seed;
+        head.draw_count = draws.size();
+        head.draws_offset = sizeof(head);
+        head.table_offset = head.draws_offset + draws.size() * sizeof(int64_t);
+        head.data_offset = snapshot::round_up(head.table_offset + table.size() * sizeof(int64_t),
+                                              snapshot::page_size);
+        uint64_t block_bytes = uint64_t(head.block_size) * sizeof(int64_t);
+        uint64_t stride = snapshot::round_up(block_bytes, snapshot::page_size);
+
+        head.file_size = head.data_offset + block_count * stride;
+        head.meta_checksum = snapshot::checksum(table.data(), table.size(),
+                                                snapshot::checksum(draws.data(), draws.size(), 0));
+
+        // A graph loaded from path still reads its blocks from the file, so
+        // the snapshot is written beside it and renamed over it when complete
+        std::string temporary = path + ".tmp";
+        std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+
+        // The header goes last, when the checksum of the blocks is known
+        std::vector<char> padding(head.data_offset - sizeof(head) - draws.size() * sizeof(int64_t)
+                                  - table.size() * sizeof(int64_t), 0);
+
+        file.write(reinterpret_cast<const char *>(&head), sizeof(head));
+        file.write(reinterpret_cast<const char *>(draws.data()), draws.size() * sizeof(int64_t));
+        file.write(reinterpret_cast<const char *>(table.data()), table.size() * sizeof(int64_t));
+        file.write(padding.data(), padding.size());
+
+        std::vector<char> page(snapshot::page_size);
+        uint64_t page_number = 0;
+
+        for (int64_t i = 0; i < m_vertex_count; ++i)
+        {
+            if (table[i] < 0)
+            {
+                continue;
+            }
+
+            const char * block = reinterpret_cast<const char *>(m_store.block(i));
+
+            for (uint64_t offset = 0; offset < stride; offset += snapshot::page_size, ++page_number)
+            {
+                const char * source = block + offset;
+
+                // The last page of a block is padded with zeros
+                if (block_bytes - offset < snapshot::page_size)
+                {
+                    std::memcpy(page.data(), source, block_bytes - offset);
+                    std::memset(page.data() + block_bytes - offset, 0,
+                                snapshot::page_size - (block_bytes - offset));
+
+                    source = page.data();
+                }
+
+                if (snapshot::zero(source, snapshot::page_size))
+                {
+                    file.seekp(snapshot::page_size, std::ios::cur);
+                    continue;
+                }
+
+                head.data_checksum += snapshot::checksum(source, snapshot::page_size / sizeof(uint64_t),
+                                                         page_number);
+                file.write(source, snapshot::page_size);
+            }
+        }
+
+        head.header_checksum = snapshot::checksum(&head, offsetof(snapshot::header, header_checksum)
+                                                  / sizeof(uint64_t), 0);
+
+        file.seekp(0);
+        file.write(reinterpret_cast<const char *>(&head), sizeof(head));
+        file.close();
+
+        // Zero pages at the end are holes past the last write
+        if (!file || ::truncate(temporary.c_str(), off_t(head.file_size)) != 0)
+        {
+            std::remove(temporary.c_str());
+            throw std::runtime_error("cannot write snapshot " + path);
+        }
+
+        snapshot::sync_path(temporary);
+
+        if (std::rename(temporary.c_str(), path.c_str()) != 0)
+        {
+            std::remove(temporary.c_str());
+            throw std::runtime_error("cannot replace snapshot " + path);
+        }
+
+        snapshot::sync_path(snapshot::directory_of(path));
+    }
+
+    // Maps a snapshot written by Save. The counters are used in place: the
+    // mapping is private, so updates copy the pages they touch and the file
+    // stays as saved. verify also checks the counters against their
+    // checksum, which reads the whole file.
+    static std::unique_ptr<DynamicGraph> Load(const std::string & path, bool verify = true)
+    {
+        int fd = ::open(path.c_str(), O_RDONLY);
+
+        if (fd < 0)
+        {
+            throw std::runtime_error("cannot open snapshot " + path);
+        }
+
+        struct stat status;
+
+        if (::fstat(fd, &status) != 0 || size_t(status.st_size) < sizeof(snapshot::header))
+        {
+            ::close(fd);
+            throw std::runtime_error("not a snapshot: " + path);
+        }
+
+        size_t size = size_t(status.st_size);
+        // Without a reservation: only the pages updates copy take memory
+        void * mapping = ::mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_NORESERVE, fd, 0);
+
+        if (mapping == MAP_FAILED)
+        {
+            ::close(fd);
+            throw std::runtime_error("cannot map snapshot " + path);
+        }
+
+        // The descriptor stays open for finding the holes of the file
+        std::shared_ptr<void> descriptor(nullptr, [fd](void *) { ::close(fd); });
+
+        auto allocator = std::make_shared<l0sample::mapped_block_allocator>(
+            static_cast<char *>(mapping), size);
+        char * base = allocator->base();
+
+        snapshot::header head;
+
+        std::memcpy(&head, base, sizeof(head));
+
+        if (std::memcmp(head.magic, snapshot::magic, sizeof(head.magic)) != 0
+            || head.header_checksum != snapshot::checksum(
+                &head, offsetof(snapshot::header, header_checksum) / sizeof(uint64_t), 0))
+        {
+            throw std::runtime_error("not a snapshot: " + path);
+        }
+
+        if (head.version != snapshot::version || head.header_size != sizeof(head))
+        {
+            throw std::runtime_error("unsupported snapshot version: " + path);
+        }
+
+        if (head.delta_inverse != delta_inverse_const)
+        {
+            throw std::runtime_error("snapshot for another delta: " + path);
+        }
+
+        uint64_t block_bytes = uint64_t(head.block_size) * sizeof(int64_t);
+        uint64_t stride = snapshot::round_up(block_bytes, snapshot::page_size);
+
+        if (head.file_size != size || head.vertex_count <= 0 || head.block_count < 0
+            || head.table_offset != head.draws_offset + head.draw_count * sizeof(int64_t)
+            || head.data_offset < head.table_offset + uint64_t(head.vertex_count) * sizeof(int64_t)
+            || head.data_offset % snapshot::page_size != 0
+            || head.data_offset + uint64_t(head.block_count) * stride != size)
+        {
+            throw std::runtime_error("corrupt snapshot: " + path);
+        }
+
+        const int64_t * draws = reinterpret_cast<const int64_t *>(base + head.draws_offset);
+        const int64_t * table = reinterpret_cast<const int64_t *>(base + head.table_offset);
+        char * data = base + head.data_offset;
+
+        bool intact = head.meta_checksum == snapshot::checksum(table, head.vertex_count,
+            snapshot::checksum(draws, head.draw_count, 0));
+
+        if (intact && verify)
+        {
+            uint64_t data_checksum = 0;
+            off_t position = off_t(head.data_offset);
+
+            // Only the extents with data; where the file system cannot tell,
+            // the whole rest of the file is one extent
+            while (position < off_t(size))
+            {
+                off_t first = ::lseek(fd, position, SEEK_DATA);
+
+                if (first < 0)
+                {
+                    break;
+                }
+
+                off_t last = ::lseek(fd, first, SEEK_HOLE);
+
+                if (last < 0)
+                {
+                    last = off_t(size);
+                }
+
+                uint64_t page = (uint64_t(first) - head.data_offset) / snapshot::page_size;
+
+                for (; head.data_offset + page * snapshot::page_size < uint64_t(last); ++page)
+                {
+                    data_checksum += snapshot::page_checksum(
+                        data + page * snapshot::page_size, page);
+                }
+
+                position = off_t(head.data_offset + page * snapshot::page_size);
+            }
+
+            intact = data_checksum == head.data_checksum;
+        }
+
+        if (!intact)
+        {
+            throw std::runtime_error("corrupt snapshot: " + path);
+        }
+
+        // The schemas draw the saved values again, in the same order
+        uint64_t next = 0;
+
+        auto replay = [&](int64_t bound) -> int64_t
+        {
+            if (next == head.draw_count || draws[next] < 0 || draws[next] >= bound)
+            {
+                throw std::runtime_error("snapshot of another layout: " + path);
+            }
+
+            return draws[next++];
+        };
+
+        std::unique_ptr<DynamicGraph> graph(new DynamicGraph(head.vertex_count, head.seed,
+            [&replay](int64_t) { return l0sample::draw_function(std::ref(replay)); }, allocator));
+
+        if (next != head.draw_count || graph->m_store.block_size() != head.block_size)
+        {
+            throw std::runtime_error("snapshot of another layout: " + path);
+        }
+
+        for (int64_t i = 0; i < head.vertex_count; ++i)
+        {
+            if (table[i] < -1 || table[i] >= head.block_count)
+            {
+                throw std::runtime_error("corrupt snapshot: " + path);
+            }
+
+            if (table[i] >= 0)
+            {
+                graph->m_store.adopt(i, reinterpret_cast<int64_t *>(data + table[i] * stride));
+            }
+        }
+
+        // The adopted blocks count as an update: no state kept next to the
+        // sketches, such as exact components, may take the graph for empty
+        graph->merged();
+
+        return graph;
+    }
+
+    // Adds the sketches of other, which must have the same schemas (the same
+    // vertex count and seed): the result is the sketch of the union of both
+    // update streams. Runs on the threads set by SetThreadCount.
+    void Merge(const DynamicGraph & other)
+    {
+        check_mergeable(other.m_vertex_count, other.m_store.block_size(), other.schema_checksum());
+
+        auto merge_vertex = [this, &other](size_t, int64_t vertex)
+        {
+            if (other.m_store.materialized(vertex))
+            {
+                add_block(m_store.block(vertex), other.m_store.block(vertex));
+            }
+        };
+
+        if (m_pool)
+        {
+            m_pool->parallel_for(m_vertex_count, merge_vertex);
+        }
+        else
+        {
+            for (int64_t i = 0; i < m_vertex_count; ++i)
+            {
+                merge_vertex(0, i);
+            }
+        }
+
+        merged();
+    }
+
+    // Writes the sketches in the partial format of namespace snapshot, which
+    // MergeSketches of a graph with the same schemas reads, e.g. from a pipe.
+    // Only the nonzero pages of the vertices with updates are written.
+    void ExportSketches(std::ostream & output) const
+    {
+        snapshot::partial_header head;
+
+        std::memset(&head, 0, sizeof(head));
+        std::memcpy(head.magic, snapshot::partial_magic, sizeof(head.magic));
+
+        head.version = snapshot::version;
+        head.header_size = sizeof(head);
+        head.vertex_count = m_vertex_count;
+        head.delta_inverse = delta_inverse_const;
+        head.block_size = m_store.block_size();
+        head.schema_checksum = schema_checksum();
+
+        output.write(reinterpret_cast<const char *>(&head), sizeof(head));
+
+        uint64_t block_bytes = uint64_t(head.block_size) * sizeof(int64_t);
+        uint64_t page_count = snapshot::round_up(block_bytes, snapshot::page_size) / snapshot::page_size;
+        uint64_t data_checksum = 0;
+
+        std::vector<char> page(snapshot::page_size);
+        std::vector<int64_t> pages;
+
+        for (int64_t i = 0; i < m_vertex_count; ++i)
+        {
+            if (!m_store.materialized(i))
+            {
+                continue;
+            }
+
+            const char * block = reinterpret_cast<const char *>(m_store.block(i));
+
+            pages.clear();
+
+            for (uint64_t j = 0; j < page_count; ++j)
+            {
+                if (!snapshot::zero(block_page(block, block_bytes, j, page), snapshot::page_size))
+                {
+                    pages.push_back(int64_t(j));
+                }
+            }
+
+            if (pages.empty())
+            {
+                continue;
+            }
+
+            int64_t record[2] = { i, int64_t(pages.size()) };
+
+            output.write(reinterpret_cast<const char *>(record), sizeof(record));
+
+            for (auto j : pages)
+            {
+                const char * source = block_page(block, block_bytes, j, page);
+
+                data_checksum = snapshot::checksum(source, snapshot::page_size / sizeof(uint64_t),
+                                                   data_checksum);
+
+                output.write(reinterpret_cast<const char *>(&j), sizeof(j));
+                output.write(source, snapshot::page_size);
+            }
+        }
+
+        int64_t trailer[2] = { -1, int64_t(data_checksum) };
+
+        output.write(reinterpret_cast<const char *>(trailer), sizeof(trailer));
+
+        if (!output)
+        {
+            throw std::runtime_error("cannot write partial sketches");
+        }
+    }
+
+    // Adds partial sketches written by ExportSketches of a graph with the
+    // same schemas, like Merge. A stream which does not verify leaves the
+    // graph with part of its pages added and throws.
+    void MergeSketches(std::istream & input)
+    {
+        snapshot::partial_header head;
+
+        if (!input.read(reinterpret_cast<char *>(&head), sizeof(head))
+            || std::memcmp(head.magic, snapshot::partial_magic, sizeof(head.magic)) != 0
+            || head.version != snapshot::version || head.header_size != sizeof(head)
+            || head.delta_inverse != delta_inverse_const)
+        {
+            throw std::runtime_error("not a partial sketch stream");
+        }
+
+        check_mergeable(head.vertex_count, head.block_size, head.schema_checksum);
+
+        uint64_t block_bytes = uint64_t(head.block_size) * sizeof(int64_t);
+        uint64_t page_count = snapshot::round_up(block_bytes, snapshot::page_size) / snapshot::page_size;
+        uint64_t data_checksum = 0;
+
+        // The pages of a vertex are put into a zero block, which is added to
+        // the sketch of the vertex and then cleared again page by page
+        l0sample::counter_vector scratch(page_count * snapshot::page_size / sizeof(int64_t), 0);
+        char * block = reinterpret_cast<char *>(scratch.data());
+        std::vector<int64_t> pages;
+
+        merged();
+
+        for (;;)
+        {
+            int64_t record[2];
+
+            if (!input.read(reinterpret_cast<char *>(record), sizeof(record)))
+            {
+                throw std::runtime_error("truncated partial sketch stream");
+            }
+
+            if (record[0] == -1)
+            {
+                if (uint64_t(record[1]) != data_checksum)
+                {
+                    throw std::runtime_error("corrupt partial sketch stream");
+                }
+
+                return;
+            }
+
+            if (record[0] < 0 || record[0] >= m_vertex_count
+                || record[1] <= 0 || uint64_t(record[1]) > page_count)
+            {
+                throw std::runtime_error("corrupt partial sketch stream");
+            }
+
+            pages.resize(record[1]);
+
+            for (auto & j : pages)
+            {
+                if (!input.read(reinterpret_cast<char *>(&j), sizeof(j)) || j < 0
+                    || uint64_t(j) >= page_count
+                    || !input.read(block + j * snapshot::page_size, snapshot::page_size))
+                {
+                    throw std::runtime_error("truncated partial sketch stream");
+                }
+
+                data_checksum = snapshot::checksum(block + j * snapshot::page_size,
+                                                   snapshot::page_size / sizeof(uint64_t), data_checksum);
+            }
+
+            add_block(m_store.block(record[0]), scratch.data());
+
+            for (auto j : pages)
+            {
+                std::memset(block + j * snapshot::page_size, 0, snapshot::page_size);
+            }
+        }
+    }
+
+    // Changes with every update of the graph
+    uint64_t Version() const
+    {
+        return __atomic_load_n(&m_version, __ATOMIC_ACQUIRE);
+    }
+
+    // Whether GetComponentsNumber would return the result of the last query
+    // without recomputing it: nothing changed since that query
+    bool HasCachedResult() const
+    {
+        std::lock_guard<std::mutex> lock(m_query_mutex);
+
+        return m_cached_count >= 0 && m_cached_version == Version();
+    }
+
+    int64_t GetComponentsNumber() const
+    {
+        std::lock_guard<std::mutex> lock(m_query_mutex);
+
+        return query(false);
+    }
+
+    // Component of every vertex: entry u - 1 is the component of vertex u.
+    // Components are numbered from 0 in the order of their smallest vertex.
+    std::vector<int64_t> GetComponentLabels() const
+    {
+        std::lock_guard<std::mutex> lock(m_query_mutex);
+
+        query(true);
+
+        return std::vector<int64_t>(m_labels.begin(), m_labels.end());
+    }
+
+    // Edges (u, v), u < v, of a spanning forest of the graph recovered from
+    // the sketches: the edges Boruvka joins components with
+    std::vector< std::pair<int64_t, int64_t> > GetSpanningForest() const
+    {
+        std::vector< std::pair<int64_t, int64_t> > edges;
+
+        GetSpanningForest([&edges](int64_t u, int64_t v) { edges.emplace_back(u, v); });
+
+        return edges;
+    }
+
+    // Hands every forest edge over as soon as Boruvka finds it. The callback
+    // runs under the query lock, so it must not query the graph.
+    void GetSpanningForest(const std::function<void(int64_t, int64_t)> & callback) const
+    {
+        std::lock_guard<std::mutex> lock(m_query_mutex);
+
+        m_query_arena.reset();
+
+        arena_allocator<uint32_t> allocator(&m_query_arena);
+
+        // Always from scratch: the shortcuts of the other queries skip the
+        // edges inside known components
+        query_units units(allocator);
+
+        add_vertex_units(units);
+
+        dsu _dsu(m_vertex_count);
+        id_list label(m_vertex_count, 0, allocator);
+        id_list offsets(allocator);
+        id_list members(m_vertex_count, 0, allocator);
+        std::vector< char, arena_allocator<char> > settled(allocator);
+
+        run_boruvka(units, _dsu, label, offsets, members, settled, &callback);
+    }
+
+    int64_t ComponentOf(int64_t u) const
+    {
+        std::lock_guard<std::mutex> lock(m_query_mutex);
+
+        query(true);
+
+        return m_labels[u - 1];
+    }
+
+    bool Connected(int64_t u, int64_t v) const
+    {
+        std::lock_guard<std::mutex> lock(m_query_mutex);
+
+        query(true);
+
+        return m_labels[u - 1] == m_labels[v - 1];
+    }
+
+private:
+    friend class ShardedIngestor;
+    friend class ConcurrentDynamicGraph;
+
+    // Sketch i takes its random values from schema_draws(i)
+    DynamicGraph(int64_t vertex_count, uint64_t seed,
+                 const std::function<l0sample::draw_function(int64_t)> & schema_draws,
+                 std::shared_ptr<l0sample::block_allocator> allocator)
+        : m_vertex_count(vertex_count),
+        m_sketch_count(1 + int64_t(std::ceil(std::log2(vertex_count)))),
+        m_seed(seed),
+        m_query_random(l0sample::derive_seed(seed, query_stream)),
+        m_version(0), m_cached_version(0), m_cached_count(-1),
+        m_labels_version(0),
+        m_exact_inserts(false), m_exact_valid(false), m_exact(0), m_exact_count(0),
+        m_incremental(false), m_partition_stale(false)
+    {
+        // std::cout << "DynamicGraph: " << "vertex count: " << m_vertex_count
+        //             << "; k: " << m_sketch_count << "\n";
+
+        int64_t pow = int64_t(std::pow(m_vertex_count, 2));
+
+        for (auto i = 0; i < m_sketch_count; ++i)
+        {
+            m_schema.push_back(
+                std::make_shared<const l0sample::sketch_schema>(pow, delta_const, schema_draws(i)));
+        }
+
+        // All counters of a vertex are kept in one block, one segment per sketch
+        m_segment = m_schema.empty() ? 0
+            : l0sample::align_counters(m_schema.front()->counter_count());
+
+        m_store = l0sample::sketch_store(m_vertex_count, m_segment * int64_t(m_schema.size()),
+                                         allocator);
+    }
+
+
+    static constexpr size_t batch_chunk = 1024;
+
+    // One endpoint of an edge of the current chunk
+    struct half_update
+    {
+        int64_t vertex;
+        int64_t edge;
+        bool negate;
+    };
+
+    void update_edge(int64_t u, int64_t v, int64_t delta)
+    {
+        if (u > v) std::swap(u, v);
+
+        u--;
+        v--;
+
+        int64_t edge_number = u * m_vertex_count + v;
+        bool tracked = !m_representative.empty();
+
+        record_update();
+
+        if (tracked)
+        {
+            mark_components(u, v, delta);
+        }
+
+        if (m_exact_valid)
+        {
+            add_exact(u, v, delta);
+        }
+
+        for (auto i = 0; i < m_sketch_count; ++i)
+        {
+            m_schema[i]->prepare(edge_number, delta, m_plan);
+
+            mutable_sketch(i, u).apply(m_plan);
+            mutable_sketch(i, v).apply(m_plan, true);
+
+            if (tracked)
+            {
+                update_aggregates(i, u, v, m_plan);
+            }
+        }
+    }
+
+    // update_edge for concurrent callers, with plan as the caller's scratch
+    void update_edge_atomic(int64_t u, int64_t v, int64_t delta, l0sample::update_plan & plan)
+    {
+        if (u > v) std::swap(u, v);
+
+        u--;
+        v--;
+
+        int64_t edge_number = u * m_vertex_count + v;
+
+        record_update();
+        mark_partition_stale();
+
+        for (auto i = 0; i < m_sketch_count; ++i)
+        {
+            m_schema[i]->prepare(edge_number, delta, plan);
+
+            mutable_sketch(i, u).apply_atomic(plan);
+            mutable_sketch(i, v).apply_atomic(plan, true);
+        }
+    }
+
+    void apply_chunk(const EdgeUpdate * updates, size_t count)
+    {
+        // Net delta per edge: the sketches are linear, so opposite updates cancel
+        m_batch_edges.clear();
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            int64_t u = std::min(updates[i].u, updates[i].v) - 1;
+            int64_t v = std::max(updates[i].u, updates[i].v) - 1;
+
+            m_batch_edges.push_back(std::make_pair(u * m_vertex_count + v, updates[i].delta));
+        }
+
+        std::sort(m_batch_edges.begin(), m_batch_edges.end());
+
+        size_t edge_count = 0;
+
+        for (size_t i = 0; i < m_batch_edges.size(); ++i)
+        {
+            if (edge_count > 0 && m_batch_edges[edge_count - 1].first == m_batch_edges[i].first)
+            {
+                m_batch_edges[edge_count - 1].second += m_batch_edges[i].second;
+            }
+            else
+            {
+                if (edge_count > 0 && m_batch_edges[edge_count - 1].second == 0)
+                {
+                    --edge_count;
+                }
+
+                m_batch_edges[edge_count++] = m_batch_edges[i];
+            }
+        }
+
+        if (edge_count > 0 && m_batch_edges[edge_count - 1].second == 0)
+        {
+            --edge_count;
+        }
+
+        m_batch_edges.resize(edge_count);
+
+        m_batch_halves.clear();
+
+        for (size_t i = 0; i < edge_count; ++i)
+        {
+            int64_t edge_number = m_batch_edges[i].first;
+
+            m_batch_halves.push_back({ edge_number / m_vertex_count, int64_t(i), false });
+            m_batch_halves.push_back({ edge_number % m_vertex_count, int64_t(i), true });
+        }
+
+        std::sort(m_batch_halves.begin(), m_batch_halves.end(),
+            [](const half_update & a, const half_update & b)
+            {
+                return a.vertex != b.vertex ? a.vertex < b.vertex : a.edge < b.edge;
+            });
+
+        if (m_batch_plans.size() < edge_count)
+        {
+            m_batch_plans.resize(edge_count);
+        }
+
+        bool tracked = !m_representative.empty();
+
+        record_update();
+
+        for (size_t i = 0; i < edge_count && m_exact_valid; ++i)
+        {
+            add_exact(m_batch_edges[i].first / m_vertex_count,
+                      m_batch_edges[i].first % m_vertex_count, m_batch_edges[i].second);
+        }
+
+        for (size_t i = 0; i < edge_count && tracked; ++i)
+        {
+            mark_components(m_batch_edges[i].first / m_vertex_count,
+                            m_batch_edges[i].first % m_vertex_count, m_batch_edges[i].second);
+        }
+
+        for (auto lev = 0; lev < m_sketch_count; ++lev)
+        {
+            for (size_t i = 0; i < edge_count; ++i)
+            {
+                m_schema[lev]->prepare(m_batch_edges[i].first, m_batch_edges[i].second,
+                                       m_batch_plans[i]);
+            }
+
+            for (auto & half : m_batch_halves)
+            {
+                mutable_sketch(lev, half.vertex).apply(m_batch_plans[half.edge], half.negate);
+            }
+
+            for (size_t i = 0; i < edge_count && tracked; ++i)
+            {
+                update_aggregates(lev, m_batch_edges[i].first / m_vertex_count,
+                                  m_batch_edges[i].first % m_vertex_count, m_batch_plans[i]);
+            }
+        }
+    }
+
+    using id_list = std::vector< uint32_t, arena_allocator<uint32_t> >;
+
+    // Numbers the sets of `sets` over ids [0, id_count) in the order of their
+    // smallest id and fills label (id -> component) and the CSR lists
+    // offsets / members with the ids of every component in increasing order.
+    // Returns the number of components.
+    int64_t index_components(dsu & sets, int64_t id_count,
+                             id_list & label, id_list & offsets, id_list & members) const
+    {
+        const uint32_t none = UINT32_MAX;
+
+        // members first maps a root to its component, then is overwritten
+        std::fill(members.begin(), members.end(), none);
+
+        uint32_t count = 0;
+
+        for (int64_t i = 0; i < id_count; ++i)
+        {
+            uint32_t root = sets.find(uint32_t(i));
+
+            if (members[root] == none)
+            {
+                members[root] = count++;
+            }
+
+            label[i] = members[root];
+        }
+
+        offsets.assign(count + 1, 0);
+
+        for (int64_t i = 0; i < id_count; ++i)
+        {
+            ++offsets[label[i] + 1];
+        }
+
+        for (uint32_t c = 0; c < count; ++c)
+        {
+            offsets[c + 1] += offsets[c];
+        }
+
+        // Filled from the back, offsets[c + 1] moves from the end of
+        // component c to its start
+        for (int64_t i = id_count - 1; i >= 0; --i)
+        {
+            members[--offsets[label[i] + 1]] = uint32_t(i);
+        }
+
+        for (uint32_t c = 0; c < count; ++c)
+        {
+            offsets[c] = offsets[c + 1];
+        }
+
+        offsets[count] = uint32_t(id_count);
+
+        return count;
     }
 
-private:
-    int64_t m_vertex_count;
-    std::vector<int64_t> m_rank;
-    std::vector<int64_t> m_parent;
-};
+    // Runs a query unless the cached result is current; with labels it also
+    // makes sure m_labels is. The caller holds m_query_mutex.
+    int64_t query(bool labels) const
+    {
+        uint64_t version = Version();
+        bool labels_current = m_labels_version == version && !m_labels.empty();
+
+        if (m_cached_count >= 0 && m_cached_version == version && (!labels || labels_current))
+        {
+            return m_cached_count;
+        }
+
+        // Queries share the scratch of the graph, which is only freed with it:
+        // everything below comes from the query arena
+        m_query_arena.reset();
+
+        arena_allocator<uint32_t> allocator(&m_query_arena);
+
+        id_list roots(m_vertex_count, 0, allocator);
+
+        if (m_exact_inserts && __atomic_load_n(&m_exact_valid, __ATOMIC_ACQUIRE))
+        {
+            m_cached_version = version;
+            m_cached_count = m_exact_count;
+
+            if (labels)
+            {
+                for (int64_t i = 0; i < m_vertex_count; ++i)
+                {
+                    roots[i] = m_exact.find(uint32_t(i));
+                }
+
+                number_components(roots, version);
+            }
 
-constexpr double delta_const = 0.01;
+            return m_cached_count;
+        }
 
-class DynamicGraph
-{
-public:
-    explicit DynamicGraph(int64_t vertex_count)
-        : m_vertex_count(vertex_count),
-        m_sketch_count(1 + int64_t(std::ceil(std::log2(vertex_count))))
-    {
-        // std::cout << "DynamicGraph: " << "vertex count: " << m_vertex_count
-        //             << "; k: " << m_sketch_count << "\n";
+        bool incremental = !m_representative.empty()
+            && !__atomic_load_n(&m_partition_stale, __ATOMIC_ACQUIRE);
 
-        int64_t pow = int64_t(std::pow(m_vertex_count, 2));
-        for (auto i = 0; i < m_sketch_count; ++i)
+        query_units units(allocator);
+        int64_t kept = 0;
+
+        if (incremental)
+        {
+            kept = collect_units(units);
+        }
+        else
+        {
+            add_vertex_units(units);
+        }
+
+        int64_t unit_count = int64_t(units.vertex.size());
+
+        dsu _dsu(unit_count);
+
+        // Components of units as CSR lists: the units of component c are
+        // members[offsets[c]], ..., members[offsets[c + 1] - 1]
+        id_list label(unit_count, 0, allocator);
+        id_list offsets(allocator);
+        id_list members(unit_count, 0, allocator);
+        std::vector< char, arena_allocator<char> > settled(allocator);
+
+        int64_t component_count = run_boruvka(units, _dsu, label, offsets, members, settled);
+
+        // Smallest vertex of the component of every vertex; vertices left out
+        // of an incremental query keep their component
+        for (int64_t i = 0; i < m_vertex_count; ++i)
+        {
+            roots[i] = units.unit_of[i] == UINT32_MAX ? m_representative[i]
+                : units.vertex[members[offsets[label[units.unit_of[i]]]]];
+        }
+
+        if (m_incremental)
+        {
+            if (!incremental)
+            {
+                start_partition();
+            }
+
+            record_partition(units, label, offsets, members, settled);
+        }
+
+        m_cached_version = version;
+        m_cached_count = kept + component_count;
+
+        number_components(roots, version);
+
+        if (m_exact_inserts)
         {
-            m_sketch.push_back(generate_graph_sketch(
-                                    m_vertex_count, pow, delta_const));
+            restart_exact(roots);
         }
+
+        return m_cached_count;
     }
 
-    void AddEdge(int64_t u, int64_t v)
+    // Numbers the components given by a root vertex per vertex in the
+    // order of their smallest vertex and stores the numbers in m_labels
+    void number_components(const id_list & roots, uint64_t version) const
     {
-        if (u > v) std::swap(u, v);
-
-        u--;
-        v--;
+        id_list number(m_vertex_count, UINT32_MAX, roots.get_allocator());
+        uint32_t count = 0;
 
-        int64_t edge_number = u * m_vertex_count + v;
+        m_labels.resize(m_vertex_count);
 
-        for (auto i = 0; i < m_sketch_count; ++i)
+        for (int64_t i = 0; i < m_vertex_count; ++i)
         {
-            m_sketch[i][u].update(edge_number, +1);
-            m_sketch[i][v].update(edge_number, -1);
+            if (number[roots[i]] == UINT32_MAX)
+            {
+                number[roots[i]] = count++;
+            }
+
+            m_labels[i] = number[roots[i]];
         }
+
+        m_labels_version = version;
     }
 
-    void RemoveEdge(int64_t u, int64_t v)
+    // Input of a Boruvka run. Unit i is the set of vertices that unit_of maps
+    // to i: its smallest vertex is vertex[i], it has size[i] vertices and
+    // blocks[i] is the sum of their sketches (nullptr when zero), which is
+    // a component aggregate when aggregated[i] is set and a vertex block
+    // otherwise. Vertices left out of the run map to UINT32_MAX.
+    struct query_units
     {
-        if (u > v) std::swap(u, v);
+        explicit query_units(const arena_allocator<uint32_t> & allocator)
+            : unit_of(allocator), vertex(allocator), size(allocator),
+            blocks(allocator), aggregated(allocator)
+        {
+        }
 
-        u--;
-        v--;
+        uint32_t add(int64_t vertex_, const int64_t * block, uint32_t size_, bool aggregated_)
+        {
+            vertex.push_back(uint32_t(vertex_));
+            size.push_back(size_);
+            blocks.push_back(block);
+            aggregated.push_back(aggregated_);
 
-        int64_t edge_number = u * m_vertex_count + v;
+            return uint32_t(vertex.size() - 1);
+        }
 
-        for (auto i = 0; i < m_sketch_count; ++i)
+        id_list unit_of;
+        id_list vertex;
+        id_list size;
+        std::vector< const int64_t *, arena_allocator<const int64_t *> > blocks;
+        std::vector< char, arena_allocator<char> > aggregated;
+    };
+
+    // Every vertex as a unit of its own
+    void add_vertex_units(query_units & units) const
+    {
+        for (int64_t i = 0; i < m_vertex_count; ++i)
         {
-            m_sketch[i][u].update(edge_number, -1);
-            m_sketch[i][v].update(edge_number, +1);
+            units.unit_of.push_back(units.add(i, vertex_block(i), 1, false));
         }
     }
 
-    int64_t GetComponentsNumber() const
+    // Boruvka over units, one sketch per round. Leaves the components of
+    // units in sets / label / offsets / members and returns their number;
+    // settled[c] is set when component c is known to have no edge leaving it.
+    // Every sampled edge that joins two components goes to forest_edge.
+    int64_t run_boruvka(const query_units & units, dsu & sets, id_list & label, id_list & offsets,
+                        id_list & members, std::vector< char, arena_allocator<char> > & settled,
+                        const std::function<void(int64_t, int64_t)> * forest_edge = nullptr) const
     {
-        std::map< int64_t, std::vector<int64_t> > cur_cc;
+        arena_allocator<uint32_t> allocator(&m_query_arena);
 
-        for (int64_t i = 0; i < m_vertex_count; ++i)
+        int64_t unit_count = int64_t(units.vertex.size());
+        int64_t component_count = index_components(sets, unit_count, label, offsets, members);
+
+        size_t workers = m_pool ? m_pool->size() : 1;
+
+        // Scratch of every worker, reused by every component on every level
+        std::vector< int64_t *, arena_allocator<int64_t *> > sketch_sum(allocator);
+
+        for (size_t i = 0; i < workers; ++i)
         {
-            cur_cc[i] = { i };
+            sketch_sum.push_back(static_cast<int64_t *>(m_query_arena.allocate(
+                m_segment * sizeof(int64_t), l0sample::cache_line_size)));
         }
 
-        dsu _dsu(m_vertex_count);
+        m_query_recovered.resize(workers);
 
-        for (int64_t lev = 0; lev < m_sketch_count; ++lev)
+        std::vector< std::pair<int64_t, int64_t>,
+                     arena_allocator< std::pair<int64_t, int64_t> > > samples(allocator);
+        std::vector< char, arena_allocator<char> > isolated(allocator);
+
+        // Whether isolated describes the current components
+        bool checked = false;
+
+        for (int64_t lev = 0; lev < m_sketch_count && component_count > 1; ++lev)
         {
-            std::map<int64_t, l0sample::main_vector> sketch_sum;
+            samples.assign(component_count, std::make_pair(0, 0));
+            isolated.assign(component_count, 0);
 
-            for (auto it = cur_cc.begin(); it != cur_cc.end(); ++it)
+            // Every component samples with its own generator, so the samples
+            // do not depend on which thread handles which component
+            uint64_t seed = m_query_random();
+
+            auto sample_component = [&](size_t worker, int64_t index)
             {
-                const int64_t & key = it->first;
-                auto & component = it->second;
+                l0sample::main_vector sum(*m_schema[lev], sketch_sum[worker]);
+
+                sum.clear();
+
+                for (auto i = offsets[index]; i < offsets[index + 1]; ++i)
+                {
+                    const int64_t * block = units.blocks[members[i]];
 
-                sketch_sum[key] = m_sketch[lev][component[0]];
+                    if (block != nullptr)
+                    {
+                        sum += l0sample::main_vector(*m_schema[lev],
+                            const_cast<int64_t *>(block) + lev * m_segment);
+                    }
+                }
 
-                for (uint64_t j = 1; j < component.size(); ++j)
+                // A zero sum means no edge leaves the component
+                if (sum.zero())
                 {
-                    sketch_sum[key] = sketch_sum[key] + m_sketch[lev][component[j]];
+                    isolated[index] = 1;
+                    return;
                 }
-            }
 
-            for (auto it = sketch_sum.begin(); it != sketch_sum.end(); ++it)
+                l0sample::split_mix generator(seed + uint64_t(index));
+
+                samples[index] = sum.sample(m_query_recovered[worker], generator);
+            };
+
+            if (m_pool)
+            {
+                m_pool->parallel_for(component_count, sample_component);
+            }
+            else
             {
-                auto pair = it->second.sample();
+                for (int64_t i = 0; i < component_count; ++i)
+                {
+                    sample_component(0, i);
+                }
+            }
+
+            bool merged = false;
 
+            for (auto & pair : samples)
+            {
                 if (pair.first != 0 && pair.second != 0)
                 {
-                    int64_t u_ = pair.first / m_vertex_count;
-                    int64_t v_ = pair.first % m_vertex_count;
+                    uint32_t u_ = units.unit_of[pair.first / m_vertex_count];
+                    uint32_t v_ = units.unit_of[pair.first % m_vertex_count];
 
-                    // std::cout << "(" << u_ << ", " << v_ << ", " 
-                    //             << pair.first << ", " << m_vertex_count << ")\n";
+                    if (u_ != UINT32_MAX && v_ != UINT32_MAX && sets.union_(u_, v_))
+                    {
+                        merged = true;
 
-                    _dsu.union_(u_, v_);
+                        if (forest_edge != nullptr)
+                        {
+                            (*forest_edge)(pair.first / m_vertex_count + 1,
+                                           pair.first % m_vertex_count + 1);
+                        }
+                    }
                 }
             }
 
-            cur_cc.clear();
+            checked = !merged;
 
-            for (auto i = 0; i < m_vertex_count; ++i)
+            if (!merged)
             {
-                auto parent = _dsu.find(i);
+                // Without unions the components stay as they are: either
+                // every one of them is isolated and the answer is final, or a
+                // sample failed and the next sketch tries again
+                if (std::find(isolated.begin(), isolated.end(), 0) == isolated.end())
+                {
+                    break;
+                }
 
-                cur_cc[parent].push_back(i);
+                continue;
             }
+
+            component_count = index_components(sets, unit_count, label, offsets, members);
         }
 
-        return cur_cc.size();
+        // A single component has no edge leaving it: every other vertex is in
+        // a component without leaving edges, or there is no other vertex
+        if (component_count <= 1)
+        {
+            settled.assign(component_count, 1);
+        }
+        else if (checked)
+        {
+            settled.assign(isolated.begin(), isolated.end());
+        }
+        else
+        {
+            settled.assign(component_count, 0);
+        }
+
+        return component_count;
     }
 
-private:
-    std::vector< l0sample::main_vector >
-        generate_graph_sketch(int64_t size, int64_t msize, double delta)
+    // Flags of a component of the last query, kept at its smallest vertex
+    static constexpr uint8_t component_settled = 1;
+    static constexpr uint8_t component_touched = 2;
+    static constexpr uint8_t component_split = 4;
+
+    const int64_t * vertex_block(int64_t vertex) const
+    {
+        return m_store.materialized(vertex) ? m_store.block(vertex) : nullptr;
+    }
+
+    // Units of an incremental query: every vertex of a split component, every
+    // other component which is not both settled and untouched. Returns the
+    // number of components left out, which stay as they are.
+    int64_t collect_units(query_units & units) const
+    {
+        int64_t kept = 0;
+
+        units.unit_of.assign(m_vertex_count, UINT32_MAX);
+
+        for (int64_t i = 0; i < m_vertex_count; ++i)
+        {
+            uint32_t root = m_representative[i];
+            uint8_t flags = m_component_flags[root];
+
+            if ((flags & component_settled) && !(flags & (component_touched | component_split)))
+            {
+                kept += root == i;
+                continue;
+            }
+
+            if ((flags & component_split) || m_component_size[root] == 1)
+            {
+                if (root == i)
+                {
+                    m_aggregates.release(i);
+                }
+
+                units.unit_of[i] = units.add(i, vertex_block(i), 1, false);
+            }
+            else if (root == i)
+            {
+                units.unit_of[i] = units.add(i, m_aggregates.block(i), m_component_size[i], true);
+            }
+            else
+            {
+                units.unit_of[i] = units.unit_of[root];
+            }
+        }
+
+        return kept;
+    }
+
+    // Every vertex on its own, as if the last query had found no edges
+    void start_partition() const
+    {
+        m_representative.resize(m_vertex_count);
+
+        for (int64_t i = 0; i < m_vertex_count; ++i)
+        {
+            m_representative[i] = uint32_t(i);
+        }
+
+        m_component_size.assign(m_vertex_count, 1);
+        m_component_flags.assign(m_vertex_count, 0);
+        m_aggregates = l0sample::sketch_store(m_vertex_count, m_store.block_size());
+
+        __atomic_store_n(&m_partition_stale, false, __ATOMIC_RELEASE);
+    }
+
+    void clear_partition() const
+    {
+        m_representative.clear();
+        m_component_size.clear();
+        m_component_flags.clear();
+        m_aggregates = l0sample::sketch_store();
+    }
+
+    // Stores the components found by a Boruvka run over units: every
+    // component is kept at its smallest vertex, and the sums of its units
+    // are added into its aggregate
+    void record_partition(const query_units & units, const id_list & label, const id_list & offsets,
+                          const id_list & members,
+                          const std::vector< char, arena_allocator<char> > & settled) const
     {
-        l0sample::main_vector sketch(msize, delta);
+        int64_t component_count = int64_t(offsets.size()) - 1;
+
+        for (int64_t c = 0; c < component_count; ++c)
+        {
+            uint32_t root = units.vertex[members[offsets[c]]];
+            uint32_t size = 0;
+
+            for (auto i = offsets[c]; i < offsets[c + 1]; ++i)
+            {
+                size += units.size[members[i]];
+            }
+
+            if (size > 1)
+            {
+                int64_t * target = m_aggregates.block(root);
+
+                for (auto i = offsets[c]; i < offsets[c + 1]; ++i)
+                {
+                    uint32_t unit = members[i];
+
+                    if (units.aggregated[unit])
+                    {
+                        if (units.vertex[unit] != root)
+                        {
+                            add_block(target, m_aggregates.block(units.vertex[unit]));
+                            m_aggregates.release(units.vertex[unit]);
+                        }
+                    }
+                    else if (units.blocks[unit] != nullptr)
+                    {
+                        add_block(target, units.blocks[unit]);
+                    }
+                }
+            }
 
-        std::vector< l0sample::main_vector > result;
+            m_component_size[root] = size;
+            m_component_flags[root] = settled[c] ? component_settled : 0;
+        }
+
+        for (int64_t i = 0; i < m_vertex_count; ++i)
+        {
+            if (units.unit_of[i] != UINT32_MAX)
+            {
+                m_representative[i] = units.vertex[members[offsets[label[units.unit_of[i]]]]];
+            }
+        }
+    }
 
-        for (auto i = 0; i < size; ++i)
+    // Checksum of the random values of all schemas: graphs whose sketches
+    // can be added have the same one
+    uint64_t schema_checksum() const
+    {
+        uint64_t result = 0;
+        auto collect = [&result](int64_t value, int64_t)
+        {
+            result = snapshot::checksum(&value, 1, result);
+        };
+
+        for (auto & schema : m_schema)
         {
-            result.push_back(sketch.copy());
+            schema->for_each_draw(collect);
         }
 
         return result;
     }
 
+    void check_mergeable(int64_t vertex_count, int64_t block_size, uint64_t checksum) const
+    {
+        if (vertex_count != m_vertex_count || block_size != m_store.block_size()
+            || checksum != schema_checksum())
+        {
+            throw std::invalid_argument("sketches of another schema: "
+                                        "build both graphs with the same seed");
+        }
+    }
+
+    // The sketches changed outside the update paths
+    void merged()
+    {
+        record_update();
+        mark_partition_stale();
+    }
+
+    // Page j of a block of block_bytes bytes; the last page is copied to
+    // page and padded with zeros
+    static const char * block_page(const char * block, uint64_t block_bytes, uint64_t j,
+                                   std::vector<char> & page)
+    {
+        uint64_t offset = j * snapshot::page_size;
+
+        if (block_bytes - offset >= snapshot::page_size)
+        {
+            return block + offset;
+        }
+
+        std::memcpy(page.data(), block + offset, block_bytes - offset);
+        std::memset(page.data() + block_bytes - offset, 0, snapshot::page_size - (block_bytes - offset));
+
+        return page.data();
+    }
+
+    // target += source over the sketches of all rounds
+    void add_block(int64_t * target, const int64_t * source) const
+    {
+        for (int64_t lev = 0; lev < m_sketch_count; ++lev)
+        {
+            l0sample::main_vector sum(*m_schema[lev], target + lev * m_segment);
+
+            sum += l0sample::main_vector(*m_schema[lev],
+                const_cast<int64_t *>(source) + lev * m_segment);
+        }
+    }
+
+    void mark_components(int64_t u, int64_t v, int64_t delta)
+    {
+        uint32_t u_root = m_representative[u];
+        uint32_t v_root = m_representative[v];
+
+        m_component_flags[u_root] |= component_touched;
+        m_component_flags[v_root] |= component_touched;
+
+        // Only a deletion inside a component can split it
+        if (u_root == v_root && delta < 0)
+        {
+            m_component_flags[u_root] |= component_split;
+        }
+    }
+
+    // Applies the plan of edge u - v for sketch lev to the aggregates of the
+    // components of u and v; inside one component the two halves cancel
+    void update_aggregates(int64_t lev, int64_t u, int64_t v, const l0sample::update_plan & plan)
+    {
+        uint32_t u_root = m_representative[u];
+        uint32_t v_root = m_representative[v];
+
+        if (u_root == v_root)
+        {
+            return;
+        }
+
+        if (m_component_size[u_root] > 1)
+        {
+            l0sample::main_vector(*m_schema[lev], m_aggregates.block(u_root) + lev * m_segment)
+                .apply(plan);
+        }
+
+        if (m_component_size[v_root] > 1)
+        {
+            l0sample::main_vector(*m_schema[lev], m_aggregates.block(v_root) + lev * m_segment)
+                .apply(plan, true);
+        }
+    }
+
+    // Invalidates the cached query result; atomic for the concurrent paths
+    void record_update()
+    {
+        __atomic_fetch_add(&m_version, 1, __ATOMIC_RELEASE);
+    }
+
+    // For the update paths that cannot maintain the aggregates and the
+    // exact components
+    void mark_partition_stale()
+    {
+        if (m_incremental && !__atomic_load_n(&m_partition_stale, __ATOMIC_RELAXED))
+        {
+            __atomic_store_n(&m_partition_stale, true, __ATOMIC_RELAXED);
+        }
+
+        if (__atomic_load_n(&m_exact_valid, __ATOMIC_RELAXED))
+        {
+            __atomic_store_n(&m_exact_valid, false, __ATOMIC_RELAXED);
+        }
+    }
+
+    // Edge u - v gained delta copies: an addition joins two exact
+    // components, a deletion may split one and drops the union-find
+    void add_exact(int64_t u, int64_t v, int64_t delta)
+    {
+        if (delta < 0)
+        {
+            m_exact_valid = false;
+        }
+        else if (delta > 0 && m_exact.union_(uint32_t(u), uint32_t(v)))
+        {
+            --m_exact_count;
+        }
+    }
+
+    // Starts the union-find again from the components a query found
+    void restart_exact(const id_list & roots) const
+    {
+        m_exact = dsu(m_vertex_count);
+        m_exact_count = m_cached_count;
+
+        for (int64_t i = 0; i < m_vertex_count; ++i)
+        {
+            m_exact.union_(uint32_t(i), roots[i]);
+        }
+
+        __atomic_store_n(&m_exact_valid, true, __ATOMIC_RELEASE);
+    }
+
+    // Update of one endpoint of an edge
+    struct endpoint_update
+    {
+        int64_t vertex;
+        int64_t edge;
+        int64_t delta;
+        bool negate;
+    };
+
+    // Applies endpoint updates with plan as the caller's scratch. Only the
+    // blocks of the given vertices are written, so calls on disjoint vertex
+    // sets may run concurrently.
+    void apply_endpoints(const endpoint_update * updates, size_t count, l0sample::update_plan & plan)
+    {
+        record_update();
+        mark_partition_stale();
+
+        for (auto lev = 0; lev < m_sketch_count; ++lev)
+        {
+            for (size_t i = 0; i < count; ++i)
+            {
+                m_schema[lev]->prepare(updates[i].edge, updates[i].delta, plan);
+                mutable_sketch(lev, updates[i].vertex).apply(plan, updates[i].negate);
+            }
+        }
+    }
+
+    // View for updates, allocating the block of vertex on its first update
+    l0sample::main_vector mutable_sketch(int64_t lev, int64_t vertex)
+    {
+        return l0sample::main_vector(*m_schema[lev], m_store.block(vertex) + lev * m_segment);
+    }
+
 private:
+    // Stream of the seed the queries draw from; the sketches use 0, 1, ...
+    static constexpr uint64_t query_stream = UINT64_MAX;
+
     const int64_t m_vertex_count;
     const int64_t m_sketch_count;
-
-    std::vector< std::vector<l0sample::main_vector> > m_sketch;
-};
+    const uint64_t m_seed;
+
+    std::vector< std::shared_ptr<const l0sample::sketch_schema> > m_schema;
+    int64_t m_segment;
+    l0sample::sketch_store m_store;
+
+    std::unique_ptr<thread_pool> m_pool;
+
+    // Query scratch, kept to reuse its memory
+    mutable std::mutex m_query_mutex;
+    mutable monotonic_arena m_query_arena;
+    mutable std::vector< std::vector< std::pair<int64_t, int64_t> > > m_query_recovered;
+    mutable l0sample::split_mix m_query_random;
+
+    // Version of the graph and result of the last query on it; a negative
+    // count means no query ran yet
+    uint64_t m_version;
+    mutable uint64_t m_cached_version;
+    mutable int64_t m_cached_count;
+
+    // Component numbers of the vertices, current at m_labels_version
+    mutable std::vector<uint32_t> m_labels;
+    mutable uint64_t m_labels_version;
+
+    // Exact components while only edges were added since the last query
+    bool m_exact_inserts;
+    mutable bool m_exact_valid;
+    mutable dsu m_exact;
+    mutable int64_t m_exact_count;
+
+    // Components of the last query, when incremental queries are on: the
+    // smallest vertex of the component of every vertex, and at that vertex
+    // the size, the flags and the sum of the sketches of the component
+    bool m_incremental;
+    mutable bool m_partition_stale;
+    mutable std::vector<uint32_t> m_representative;
+    mutable std::vector<uint32_t> m_component_size;
+    mutable std::vector<uint8_t> m_component_flags;
+    mutable l0sample::sketch_store m_aggregates;
+
+    // Update scratch, kept to reuse its capacity
+    l0sample::update_plan m_plan;
+    std::vector< l0sample::update_plan > m_batch_plans;
+    std::vector< std::pair<int64_t, int64_t> > m_batch_edges;
+    std::vector<half_update> m_batch_halves;
+};
\ No newline at end of file
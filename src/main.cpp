@@ -2,18 +2,60 @@
 #include <string>
 #include <functional>
 #include <tuple>
+#include <set>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <sstream>
+#include <fstream>
+#include <iterator>
+#include <cstdio>
+#include <random>
 
 #include "dynamic_graph.hpp"
+#include "update_buffer.hpp"
+#include "update_stream.hpp"
+#include "write_ahead_log.hpp"
+#include "sharded_ingestor.hpp"
+#include "concurrent_dynamic_graph.hpp"
 
+std::random_device rd;
+
+std::mt19937 mt(rd());
+
+
+// tests modular
+void tests_modular();
+void tests_simd();
 
 // tests l0sample
+void tests_prime();
 void tests_fast_pow();
 void tests_one_sparse_vector();
 void tests_s_sparse_vector();
 void tests_main_vector();
+void tests_level_kernels();
 
 // tests DynamicGraph
+void tests_dsu();
 void tests_dynamic_graph();
+void tests_apply_updates();
+void tests_update_buffer();
+void tests_update_stream();
+void tests_parallel_query();
+void tests_lazy_sketches();
+void tests_incremental_queries();
+void tests_cached_queries();
+void tests_exact_inserts();
+void tests_component_labels();
+void tests_spanning_forest();
+void tests_snapshot();
+void tests_merge();
+void tests_seeded_graphs();
+void tests_write_ahead_log();
+void tests_arena();
+void tests_sharded_ingestor();
+void tests_concurrent_dynamic_graph();
 void hard_test();
 void simple_test();
 
@@ -22,14 +64,38 @@ int main()
     // std::ios::sync_with_stdio(false);
     // std::cin.tie(nullptr);
 
+    // tests modular
+    // tests_modular();
+    // tests_simd();
+
     // tests l0sample
+    // tests_prime();
     // tests_fast_pow();
     // tests_one_sparse_vector();
     // tests_s_sparse_vector();
     // tests_main_vector();
+    // tests_level_kernels();
 
     // tests DynamicGraph
+    // tests_dsu();
     // tests_dynamic_graph();
+    // tests_apply_updates();
+    // tests_update_buffer();
+    // tests_update_stream();
+    // tests_parallel_query();
+    // tests_lazy_sketches();
+    // tests_incremental_queries();
+    // tests_cached_queries();
+    // tests_exact_inserts();
+    // tests_component_labels();
+    // tests_spanning_forest();
+    // tests_snapshot();
+    // tests_merge();
+    // tests_seeded_graphs();
+    // tests_write_ahead_log();
+    // tests_arena();
+    // tests_sharded_ingestor();
+    // tests_concurrent_dynamic_graph();
     // hard_test(); 
     simple_test();
 
@@ -38,44 +104,228 @@ int main()
 
 void simple_test()
 {
-    std::cout << "Simple test: \n";
+    std::cout << "Simple test: \n" << std::flush;
+
+    // A redirected file is mapped; a pipe is read as requests come, and
+    // every answer is flushed before the next request is read
+    std::unique_ptr<MappedFile> file;
+    std::unique_ptr<TextUpdateReader> reader;
+
+    if (IsRegularFile(STDIN_FILENO))
+    {
+        file.reset(new MappedFile(STDIN_FILENO));
+        reader.reset(new TextUpdateReader(file->Data(), file->Size()));
+    }
+    else
+    {
+        reader.reset(new TextUpdateReader(STDIN_FILENO));
+    }
 
-    int64_t vertex_count, count_req;
+    DynamicGraph g(reader->VertexCount());
 
-    std::cin >> vertex_count;
-    std::cin >> count_req;
+    ReplayUpdates(g, *reader, [](int64_t count) { std::cout << count << "\n" << std::flush; });
+}
 
-    DynamicGraph g(vertex_count);
+void tests_modular()
+{
+    std::cout << "Tests modular:\n";
 
-    for (int64_t i = 0; i < count_req; ++i)
+    // Test 1
     {
-        char operation;
-        std::cin >> operation;
+        std::cout << "-- Test 1: ";
 
-        if (operation == '+')
+        uint64_t mod = 4611686018427388039ull;
+
+        if (modular::mul_mod(mod - 1, mod - 1, mod) != 1
+            || modular::pow_mod(3, mod - 1, mod) != 1)
         {
-            int64_t u, v;
+            std::cout << "False\n";
+            return;
+        }
+
+        std::cout << "True\n";
+    }
+
+    // Test 2
+    {
+        std::cout << "-- Test 2: ";
 
-            std::cin >> u;
-            std::cin >> v;
+        uint64_t mod = 1000000007;
+        modular::montgomery field(mod);
 
-            g.AddEdge(u, v);
+        if (field.from(field.mul(field.to(123456789), field.to(987654321)))
+            != modular::mul_mod(123456789, 987654321, mod))
+        {
+            std::cout << "False\n";
+            return;
         }
-        else if (operation == '-')
+
+        std::cout << "True\n";
+    }
+
+    // Test 3
+    {
+        std::cout << "-- Test 3: ";
+
+        uint64_t mod = 4611686018427388039ull;
+        std::vector<int64_t> points = { 2, 1469, 4611686018427387000ll };
+        modular::power_table table(mod, points);
+
+        for (auto i = 0u; i < points.size(); ++i)
         {
-            int64_t u, v;
+            for (uint64_t p_value : { 0ull, 1ull, 17ull, 1ull << 40, 999999999999ull })
+            {
+                if (table.scaled_power(i, p_value, 5)
+                    != modular::mul_mod(5, modular::pow_mod(points[i], p_value, mod), mod))
+                {
+                    std::cout << "False\n";
+                    return;
+                }
+            }
+        }
+
+        std::cout << "True\n";
+    }
+}
+
+void tests_simd()
+{
+    std::cout << "Tests simd:\n";
 
-            std::cin >> u;
-            std::cin >> v;
+    uint64_t mod = 1125899906842597ull;
+    std::vector<int64_t> points = { 2, 3, 1469, 20000, 301, 1191, 17, 1125899906842000ll, 5, 7, 11 };
+    int64_t count = int64_t(points.size());
 
-            g.RemoveEdge(u, v);
+    modular::power_table table(mod, points);
+    std::vector<double> float_table;
+
+    for (int64_t b = 0; b < modular::power_table::bits; ++b)
+    {
+        for (int64_t i = 0; i < count; ++i)
+        {
+            float_table.push_back(double(table.scaled_power(i, uint64_t(1) << b, 1)));
         }
-        else
+    }
+
+    std::vector< std::pair<std::string, simd::kernels> > kernels = {
+        { "scalar", simd::kernels{ simd::powers_scalar, nullptr } }
+    };
+
+#ifdef DYNAMIC_GRAPH_SIMD_X86
+    if (simd::cpu_supports_avx2())
+    {
+        kernels.push_back({ "avx2", simd::kernels{ simd::powers_avx2, simd::add_avx2 } });
+    }
+
+    if (simd::cpu_supports_avx512())
+    {
+        kernels.push_back({ "avx512", simd::kernels{ simd::powers_avx512, simd::add_avx512 } });
+    }
+#endif
+
+    for (auto & kernel : kernels)
+    {
+        std::cout << "-- Test " << kernel.first << ": ";
+
+        for (uint64_t p_value : { 0ull, 1ull, 17ull, 1ull << 40, 999999999999ull })
         {
-            std::cout << g.GetComponentsNumber() << "\n";
+            std::vector<uint64_t> result(count);
+            kernel.second.powers(float_table.data(), count, p_value, 42., double(mod),
+                                 count, result.data());
+
+            std::vector<int64_t> values(count, int64_t(mod - 1));
+
+            if (kernel.second.add != nullptr)
+            {
+                kernel.second.add(values.data(), result.data(), count, mod);
+            }
+
+            for (int64_t i = 0; i < count; ++i)
+            {
+                uint64_t expected = table.scaled_power(i, p_value, 42);
+
+                if (result[i] != expected || (kernel.second.add != nullptr
+                    && uint64_t(values[i]) != modular::add_mod(mod - 1, expected, mod)))
+                {
+                    std::cout << "False\n";
+                    return;
+                }
+            }
+        }
+
+        std::cout << "True\n";
+    }
+}
+
+void tests_prime()
+{
+    std::cout << "Tests prime:\n";
+
+    // Test 1
+    {
+        std::cout << "-- Test 1: ";
+
+        for (int64_t value = 0; value < 10000; ++value)
+        {
+            bool expected = value >= 2;
+
+            for (int64_t step = 2; step * step <= value && expected; ++step)
+            {
+                expected = value % step != 0;
+            }
+
+            if (prime::is_prime(value) != expected)
+            {
+                std::cout << "False\n";
+                return;
+            }
+        }
+
+        std::cout << "True\n";
+    }
+
+    // Test 2
+    {
+        std::cout << "-- Test 2: ";
+
+        // Strong pseudoprimes to small bases, Carmichael numbers and Mersenne primes
+        std::vector< std::pair<int64_t, bool> > values =
+        {
+            { 2047, false }, { 3215031751, false }, { 3825123056546413051, false },
+            { 1000000007, true }, { (int64_t(1) << 61) - 1, true }, { 561, false },
+            { 4611686018427387903, false }, { 4611686018427388039, true }
+        };
+
+        for (auto & value : values)
+        {
+            if (prime::is_prime(value.first) != value.second)
+            {
+                std::cout << "False\n";
+                return;
+            }
         }
+
+        std::cout << "True\n";
+    }
+
+    // Test 3
+    {
+        std::cout << "-- Test 3: ";
+
+        for (int64_t bits = 2; bits < 62; ++bits)
+        {
+            int64_t power = int64_t(1) << bits;
+
+            if (prime::prime_above_power(power) != prime::prime_more_than(power + 1)
+                || prime::prime_above_power(power - 1) != prime::prime_above_power(power))
+            {
+                std::cout << "False\n";
+                return;
+            }
+        }
+
+        std::cout << "True\n";
     }
-    
 }
 
 void tests_fast_pow()
@@ -466,6 +716,85 @@ void tests_main_vector()
     }
 }
 
+void tests_level_kernels()
+{
+    std::cout << "Tests level kernels:\n";
+
+    // Test 1
+    {
+        std::cout << "-- Test 1: ";
+
+        l0sample::s_sparse_vector fixed(400, 24, delta_const / 2.);
+        l0sample::s_sparse_vector generic = fixed.copy();
+        l0sample::s_sparse_vector other = fixed.copy();
+
+        const auto & schema = *fixed.schema;
+        auto loops = l0sample::level_loops<0, 0>();
+
+        if (schema.kernels.apply == loops.apply)
+        {
+            std::cout << "False 1\n";
+            return;
+        }
+
+        for (auto i = 0; i < 30; ++i)
+        {
+            other.update(7 * i + 3, i % 3 - 1);
+        }
+
+        std::vector<int64_t> buckets(schema.k_value);
+        std::vector<uint64_t> terms(schema.test_count);
+        std::vector<uint64_t> negated(schema.test_count);
+
+        schema.prepare(5, 2, buckets.data(), terms.data(), negated.data());
+
+        fixed.update(5, 2);
+        loops.apply(generic.counters, schema.k_value, schema.cell_count(), schema.test_count,
+                    buckets.data(), terms.data(), 5, 2, uint64_t(schema.prime_value));
+
+        fixed += other;
+        loops.merge(generic.counters, other.counters, schema.k_value, schema.cell_count(),
+                    schema.test_count, uint64_t(schema.prime_value));
+
+        if (!std::equal(fixed.counters, fixed.counters + schema.counter_count(), generic.counters))
+        {
+            std::cout << "False 2\n";
+            return;
+        }
+
+        std::cout << "True\n";
+    }
+}
+
+void tests_dsu()
+{
+    std::cout << "Tests dsu:\n";
+
+    // Test 1
+    {
+        std::cout << "-- Test 1: ";
+
+        dsu sets(100000);
+
+        // A path merged from both ends: deep chains if find did not compress
+        for (uint32_t i = 0; i + 1 < 50000; ++i)
+        {
+            sets.union_(i, i + 1);
+            sets.union_(99999 - i, 99998 - i);
+        }
+
+        if (sets.find(0) != sets.find(49999) || sets.find(0) == sets.find(50000)
+            || sets.size(123) != 50000 || sets.union_(7, 49000) || !sets.union_(0, 99999)
+            || sets.size(50000) != 100000)
+        {
+            std::cout << "False\n";
+            return;
+        }
+
+        std::cout << "True\n";
+    }
+}
+
 void tests_dynamic_graph()
 {
     std::cout << "Tests dynamic graph:\n";
@@ -710,6 +1039,1255 @@ void tests_dynamic_graph()
     }
 }
 
+void tests_apply_updates()
+{
+    std::cout << "Tests apply updates:\n";
+
+    // Test 1
+    {
+        std::cout << "-- Test 1: ";
+
+        DynamicGraph g(6);
+
+        g.AddEdges({ { 1, 2 }, { 2, 3 }, { 2, 4 }, { 3, 4 }, { 5, 6 } });
+
+        if (g.GetComponentsNumber() != 2)
+        {
+            std::cout << "False\n";
+            return;
+        }
+
+        std::cout << "True\n";
+    }
+
+    // Test 2
+    {
+        std::cout << "-- Test 2: ";
+
+        DynamicGraph g(6);
+
+        std::vector<EdgeUpdate> updates = {
+            { 1, 2, +1 }, { 3, 2, +1 }, { 2, 3, -1 }, { 4, 5, +1 },
+            { 5, 4, -1 }, { 5, 6, +1 }, { 6, 5, +1 }, { 5, 6, -1 }
+        };
+
+        g.ApplyUpdates(updates);
+
+        if (g.GetComponentsNumber() != 4)
+        {
+            std::cout << "False 1\n";
+            return;
+        }
+
+        g.RemoveEdges({ { 1, 2 }, { 5, 6 } });
+
+        if (g.GetComponentsNumber() != 6)
+        {
+            std::cout << "False 2\n";
+            return;
+        }
+
+        std::cout << "True\n";
+    }
+}
+
+void tests_update_buffer()
+{
+    std::cout << "Tests update buffer:\n";
+
+    // Test 1
+    {
+        std::cout << "-- Test 1: ";
+
+        DynamicGraph g(6);
+        UpdateBuffer buffer(g);
+
+        for (auto i = 0; i < 100; ++i)
+        {
+            buffer.AddEdge(1, 2);
+            buffer.RemoveEdge(2, 1);
+        }
+
+        buffer.AddEdge(3, 4);
+        buffer.AddEdge(4, 5);
+        buffer.RemoveEdge(3, 4);
+
+        if (buffer.Size() != 3 || buffer.GetComponentsNumber() != 5 || buffer.Size() != 0)
+        {
+            std::cout << "False\n";
+            return;
+        }
+
+        std::cout << "True\n";
+    }
+
+    // Test 2
+    {
+        std::cout << "-- Test 2: ";
+
+        DynamicGraph g(6);
+
+        {
+            UpdateBuffer buffer(g, 2);
+
+            buffer.AddEdge(1, 2);
+            buffer.AddEdge(2, 3);
+
+            if (buffer.Size() != 0)
+            {
+                std::cout << "False 1\n";
+                return;
+            }
+
+            buffer.AddEdge(5, 6);
+        }
+
+        if (g.GetComponentsNumber() != 3)
+        {
+            std::cout << "False 2\n";
+            return;
+        }
+
+        std::cout << "True\n";
+    }
+
+    // Test 3
+    {
+        std::cout << "-- Test 3: ";
+
+        DynamicGraph g(6);
+        UpdateBuffer buffer(g, 1 << 16, std::chrono::milliseconds(200));
+
+        buffer.AddEdge(1, 2);
+        buffer.Poll();
+
+        if (buffer.Size() != 1)
+        {
+            std::cout << "False 1\n";
+            return;
+        }
+
+        // No update follows: the timer of the caller flushes
+        std::this_thread::sleep_for(std::chrono::milliseconds(250));
+        buffer.Poll();
+
+        if (buffer.Size() != 0 || g.GetComponentsNumber() != 5)
+        {
+            std::cout << "False 2\n";
+            return;
+        }
+
+        std::cout << "True\n";
+    }
+}
+
+void tests_update_stream()
+{
+    std::cout << "Tests update stream:\n";
+
+    std::string text = "6 9\n+ 1 2\n+ 2 3\n?\n+ 5 4\n- 1 2\n?\n  +  6   5 \n?\n?";
+    std::vector<int64_t> expected = { 4, 4, 3, 3 };
+
+    // Test 1
+    {
+        std::cout << "-- Test 1: ";
+
+        TextUpdateReader reader(text.data(), text.size());
+        DynamicGraph g(reader.VertexCount());
+        std::vector<int64_t> answers;
+
+        int64_t count = ReplayUpdates(g, reader, [&](int64_t answer) { answers.push_back(answer); }, 2);
+
+        if (reader.VertexCount() != 6 || count != 9 || answers != expected)
+        {
+            std::cout << "False\n";
+            return;
+        }
+
+        std::cout << "True\n";
+    }
+
+    // Test 2
+    {
+        std::cout << "-- Test 2: ";
+
+        std::ostringstream binary;
+
+        {
+            TextUpdateReader reader(text.data(), text.size());
+            BinaryUpdateWriter writer(binary, reader.VertexCount());
+            StreamUpdate update;
+
+            while (reader.Next(update))
+            {
+                writer.Write(update);
+            }
+
+            writer.Write({ '-', 1000000007, 3 });
+        }
+
+        std::string path = "update_stream_test.bin";
+
+        {
+            std::ofstream file(path, std::ios::binary);
+            file << binary.str();
+        }
+
+        MappedFile file(path);
+        BinaryUpdateReader reader(file.Data(), file.Size());
+        StreamUpdate update;
+        int64_t count = 0;
+        int64_t checksum = 0;
+
+        while (reader.Next(update))
+        {
+            ++count;
+            checksum += update.op == '?' ? 1 : update.u * 10 + update.v;
+        }
+
+        std::remove(path.c_str());
+
+        if (reader.VertexCount() != 6 || count != 10 || checksum != 10000000070 + 3 + 12 + 23 + 54 + 12 + 65 + 4)
+        {
+            std::cout << "False\n";
+            return;
+        }
+
+        std::cout << "True\n";
+    }
+
+    // Test 3
+    {
+        std::cout << "-- Test 3: ";
+
+        int fds[2];
+
+        if (::pipe(fds) != 0)
+        {
+            std::cout << "False 1\n";
+            return;
+        }
+
+        std::string requests = "6 6\n+ 1 2\n?\n+ 2 3\nx\n- 1 2\n?\n";
+        std::atomic<int> answered(0);
+        bool in_time = true;
+
+        // Byte by byte, so numbers are split between reads, and every query
+        // waits for its answer before the next request is written
+        std::thread writer([&]()
+        {
+            int queries = 0;
+
+            for (char c : requests)
+            {
+                if (::write(fds[1], &c, 1) != 1)
+                {
+                    in_time = false;
+                }
+
+                if (c == '?' || c == 'x')
+                {
+                    ++queries;
+
+                    for (int i = 0; i < 2000 && answered.load() < queries; ++i)
+                    {
+                        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                    }
+
+                    in_time = in_time && answered.load() == queries;
+                }
+            }
+
+            ::close(fds[1]);
+        });
+
+        TextUpdateReader reader(fds[0], 4);
+        DynamicGraph g(reader.VertexCount());
+        std::vector<int64_t> answers;
+
+        ReplayUpdates(g, reader, [&](int64_t answer) { answers.push_back(answer); answered.fetch_add(1); });
+
+        writer.join();
+        ::close(fds[0]);
+
+        if (!in_time || answers != std::vector<int64_t>({ 5, 4, 5 }))
+        {
+            std::cout << "False 2\n";
+            return;
+        }
+
+        std::cout << "True\n";
+    }
+}
+
+void tests_parallel_query()
+{
+    std::cout << "Tests parallel query:\n";
+
+    // Test 1
+    {
+        std::cout << "-- Test 1: ";
+
+        DynamicGraph g(12);
+        g.SetThreadCount(4);
+
+        for (auto i = 1; i < 6; ++i)
+        {
+            g.AddEdge(i, i + 1);
+        }
+
+        g.AddEdge(7, 8);
+        g.AddEdge(9, 10);
+        g.AddEdge(10, 11);
+
+        if (g.GetComponentsNumber() != 4)
+        {
+            std::cout << "False 1\n";
+            return;
+        }
+
+        g.RemoveEdge(3, 4);
+        g.SetThreadCount(1);
+
+        if (g.GetComponentsNumber() != 5)
+        {
+            std::cout << "False 2\n";
+            return;
+        }
+
+        std::cout << "True\n";
+    }
+}
+
+void tests_lazy_sketches()
+{
+    std::cout << "Tests lazy sketches:\n";
+
+    // Test 1
+    {
+        std::cout << "-- Test 1: ";
+
+        DynamicGraph g(10);
+
+        if (g.MaterializedVertexCount() != 0 || g.GetComponentsNumber() != 10)
+        {
+            std::cout << "False 1\n";
+            return;
+        }
+
+        g.AddEdge(1, 2);
+        g.AddEdge(2, 1);
+        g.RemoveEdge(1, 2);
+
+        if (g.MaterializedVertexCount() != 2 || g.GetComponentsNumber() != 9)
+        {
+            std::cout << "False 2\n";
+            return;
+        }
+
+        g.SetThreadCount(3);
+        g.MaterializeSketches();
+
+        if (g.MaterializedVertexCount() != 10 || g.GetComponentsNumber() != 9)
+        {
+            std::cout << "False 3\n";
+            return;
+        }
+
+        std::cout << "True\n";
+    }
+}
+
+void tests_incremental_queries()
+{
+    std::cout << "Tests incremental queries:\n";
+
+    // Test 1
+    {
+        std::cout << "-- Test 1: ";
+
+        DynamicGraph g(12);
+        g.SetIncrementalQueries(true);
+
+        for (auto i = 1; i < 6; ++i)
+        {
+            g.AddEdge(i, i + 1);
+        }
+
+        g.AddEdge(7, 8);
+
+        if (g.GetComponentsNumber() != 6)
+        {
+            std::cout << "False 1\n";
+            return;
+        }
+
+        g.AddEdge(8, 9);
+        g.AddEdge(6, 7);
+
+        if (g.GetComponentsNumber() != 4)
+        {
+            std::cout << "False 2\n";
+            return;
+        }
+
+        g.RemoveEdge(3, 4);
+        g.AddEdge(11, 12);
+
+        if (g.GetComponentsNumber() != 4)
+        {
+            std::cout << "False 3\n";
+            return;
+        }
+
+        g.RemoveEdge(11, 12);
+        g.ApplyUpdates({ { 1, 12, 1 }, { 8, 9, -1 } });
+
+        if (g.GetComponentsNumber() != 5)
+        {
+            std::cout << "False 4\n";
+            return;
+        }
+
+        std::cout << "True\n";
+    }
+
+    // Test 2
+    {
+        std::cout << "-- Test 2: ";
+
+        DynamicGraph g(8);
+        g.SetIncrementalQueries(true);
+        g.SetThreadCount(3);
+
+        for (auto i = 1; i < 8; ++i)
+        {
+            g.AddEdge(i, i + 1);
+        }
+
+        if (g.GetComponentsNumber() != 1)
+        {
+            std::cout << "False 1\n";
+            return;
+        }
+
+        g.RemoveEdge(4, 5);
+        g.SetIncrementalQueries(false);
+
+        if (g.GetComponentsNumber() != 2)
+        {
+            std::cout << "False 2\n";
+            return;
+        }
+
+        std::cout << "True\n";
+    }
+}
+
+void tests_cached_queries()
+{
+    std::cout << "Tests cached queries:\n";
+
+    // Test 1
+    {
+        std::cout << "-- Test 1: ";
+
+        DynamicGraph g(6);
+
+        if (g.HasCachedResult() || g.GetComponentsNumber() != 6 || !g.HasCachedResult())
+        {
+            std::cout << "False 1\n";
+            return;
+        }
+
+        auto version = g.Version();
+
+        g.AddEdge(1, 2);
+        g.AddEdge(3, 4);
+
+        if (g.Version() == version || g.HasCachedResult() || g.GetComponentsNumber() != 4)
+        {
+            std::cout << "False 2\n";
+            return;
+        }
+
+        version = g.Version();
+
+        if (g.GetComponentsNumber() != 4 || g.Version() != version || !g.HasCachedResult())
+        {
+            std::cout << "False 3\n";
+            return;
+        }
+
+        g.ApplyUpdates({ { 2, 3, 1 } });
+
+        if (g.HasCachedResult() || g.GetComponentsNumber() != 3)
+        {
+            std::cout << "False 4\n";
+            return;
+        }
+
+        std::cout << "True\n";
+    }
+}
+
+void tests_exact_inserts()
+{
+    std::cout << "Tests exact inserts:\n";
+
+    // Test 1
+    {
+        std::cout << "-- Test 1: ";
+
+        DynamicGraph g(10);
+        g.SetExactInserts(true);
+
+        g.AddEdge(1, 2);
+        g.AddEdge(2, 3);
+        g.ApplyUpdates({ { 4, 5, 1 }, { 5, 6, 1 }, { 6, 4, 1 } });
+
+        if (g.GetComponentsNumber() != 6)
+        {
+            std::cout << "False 1\n";
+            return;
+        }
+
+        g.RemoveEdge(2, 3);
+
+        if (g.GetComponentsNumber() != 7)
+        {
+            std::cout << "False 2\n";
+            return;
+        }
+
+        g.AddEdge(3, 10);
+        g.ApplyUpdates({ { 7, 8, 1 }, { 4, 5, -1 } });
+
+        if (g.GetComponentsNumber() != 5)
+        {
+            std::cout << "False 3\n";
+            return;
+        }
+
+        g.AddEdge(1, 7);
+        g.AddEdge(3, 4);
+
+        if (g.GetComponentsNumber() != 3)
+        {
+            std::cout << "False 4\n";
+            return;
+        }
+
+        std::cout << "True\n";
+    }
+}
+
+void tests_component_labels()
+{
+    std::cout << "Tests component labels:\n";
+
+    // Test 1
+    {
+        std::cout << "-- Test 1: ";
+
+        DynamicGraph g(7);
+
+        g.AddEdge(2, 5);
+        g.AddEdge(5, 7);
+        g.AddEdge(3, 4);
+
+        std::vector<int64_t> expected = { 0, 1, 2, 2, 1, 3, 1 };
+
+        if (g.GetComponentLabels() != expected || g.GetComponentsNumber() != 4)
+        {
+            std::cout << "False 1\n";
+            return;
+        }
+
+        if (!g.Connected(2, 7) || g.Connected(1, 2) || g.ComponentOf(4) != 2)
+        {
+            std::cout << "False 2\n";
+            return;
+        }
+
+        g.RemoveEdge(5, 7);
+
+        if (g.Connected(2, 7) || g.ComponentOf(7) != 4 || g.GetComponentsNumber() != 5)
+        {
+            std::cout << "False 3\n";
+            return;
+        }
+
+        std::cout << "True\n";
+    }
+
+    // Test 2
+    {
+        std::cout << "-- Test 2: ";
+
+        DynamicGraph g(6);
+        g.SetExactInserts(true);
+        g.SetIncrementalQueries(true);
+
+        g.AddEdge(6, 1);
+        g.AddEdge(4, 3);
+
+        std::vector<int64_t> expected = { 0, 1, 2, 2, 3, 0 };
+
+        if (g.GetComponentsNumber() != 4 || g.GetComponentLabels() != expected)
+        {
+            std::cout << "False 1\n";
+            return;
+        }
+
+        g.RemoveEdge(1, 6);
+        g.AddEdge(5, 2);
+        expected = { 0, 1, 2, 2, 1, 3 };
+
+        if (g.GetComponentLabels() != expected || !g.Connected(2, 5))
+        {
+            std::cout << "False 2\n";
+            return;
+        }
+
+        std::cout << "True\n";
+    }
+}
+
+void tests_spanning_forest()
+{
+    std::cout << "Tests spanning forest:\n";
+
+    // Test 1
+    {
+        std::cout << "-- Test 1: ";
+
+        DynamicGraph g(8);
+        std::set< std::pair<int64_t, int64_t> > edges = { { 1, 2 }, { 2, 3 }, { 1, 3 }, { 3, 4 },
+                                                          { 5, 6 }, { 6, 7 }, { 5, 7 } };
+
+        for (auto & edge : edges)
+        {
+            g.AddEdge(edge.second, edge.first);
+        }
+
+        auto forest = g.GetSpanningForest();
+
+        if (forest.size() != 5)
+        {
+            std::cout << "False 1\n";
+            return;
+        }
+
+        DynamicGraph check(8);
+
+        for (auto & edge : forest)
+        {
+            if (edges.count(edge) == 0)
+            {
+                std::cout << "False 2\n";
+                return;
+            }
+
+            check.AddEdge(edge.first, edge.second);
+        }
+
+        if (check.GetComponentLabels() != g.GetComponentLabels())
+        {
+            std::cout << "False 3\n";
+            return;
+        }
+
+        int64_t streamed = 0;
+
+        g.GetSpanningForest([&](int64_t u, int64_t v) { streamed += edges.count({ u, v }); });
+
+        if (streamed != 5)
+        {
+            std::cout << "False 4\n";
+            return;
+        }
+
+        std::cout << "True\n";
+    }
+}
+
+void tests_snapshot()
+{
+    std::cout << "Tests snapshot:\n";
+
+    std::string path = "snapshot_test.bin";
+
+    // Test 1
+    {
+        std::cout << "-- Test 1: ";
+
+        DynamicGraph g(10);
+
+        g.AddEdge(1, 2);
+        g.AddEdge(2, 3);
+        g.AddEdge(5, 6);
+        g.AddEdge(8, 9);
+        g.RemoveEdge(2, 3);
+        g.Save(path);
+
+        auto loaded = DynamicGraph::Load(path);
+
+        if (loaded->VertexCount() != 10 || loaded->MaterializedVertexCount() != 7 || loaded->Seed() != g.Seed()
+            || loaded->GetComponentLabels() != g.GetComponentLabels())
+        {
+            std::cout << "False 1\n";
+            return;
+        }
+
+        // The loaded graph goes on from the saved state, the file does not change
+        loaded->AddEdge(3, 4);
+        loaded->AddEdge(2, 9);
+        loaded->RemoveEdge(5, 6);
+
+        if (loaded->GetComponentsNumber() != 6 || DynamicGraph::Load(path)->GetComponentsNumber() != 7)
+        {
+            std::cout << "False 2\n";
+            return;
+        }
+
+        std::cout << "True\n";
+    }
+
+    // Test 2
+    {
+        std::cout << "-- Test 2: ";
+
+        {
+            std::fstream file(path, std::ios::binary | std::ios::in | std::ios::out);
+            file.seekp(-5, std::ios::end);
+            file.put('x');
+        }
+
+        bool rejected = false;
+
+        try
+        {
+            DynamicGraph::Load(path);
+        }
+        catch (const std::runtime_error &)
+        {
+            rejected = true;
+        }
+
+        if (!rejected || DynamicGraph::Load(path, false)->VertexCount() != 10)
+        {
+            std::cout << "False\n";
+            return;
+        }
+
+        std::cout << "True\n";
+    }
+
+    // Test 3
+    {
+        std::cout << "-- Test 3: ";
+
+        DynamicGraph g(10);
+
+        g.AddEdge(1, 2);
+        g.AddEdge(4, 5);
+        g.Save(path);
+
+        // The loaded graph reads its blocks from the file it is saved over
+        auto loaded = DynamicGraph::Load(path);
+
+        loaded->AddEdge(2, 3);
+        loaded->Save(path);
+        loaded->AddEdge(7, 8);
+        loaded->Save(path);
+
+        auto reloaded = DynamicGraph::Load(path);
+
+        if (reloaded->GetComponentLabels() != loaded->GetComponentLabels() || reloaded->GetComponentsNumber() != 6)
+        {
+            std::cout << "False 1\n";
+            return;
+        }
+
+        // The seed survives the round trip, so a graph built from it has the
+        // same schemas
+        DynamicGraph fresh(10, reloaded->Seed());
+
+        fresh.AddEdge(9, 10);
+        fresh.Merge(*reloaded);
+
+        if (reloaded->Seed() != g.Seed() || fresh.GetComponentsNumber() != 5)
+        {
+            std::cout << "False 2\n";
+            return;
+        }
+
+        std::remove(path.c_str());
+
+        std::cout << "True\n";
+    }
+
+    // Test 4
+    {
+        std::cout << "-- Test 4: ";
+
+        DynamicGraph g(6);
+
+        g.AddEdge(1, 2);
+        g.AddEdge(2, 3);
+        g.AddEdge(4, 5);
+        g.Save(path);
+
+        // Exact components of a loaded graph start from the sketches
+        auto loaded = DynamicGraph::Load(path);
+
+        loaded->SetExactInserts(true);
+
+        if (loaded->GetComponentsNumber() != 3 || !loaded->Connected(1, 3))
+        {
+            std::cout << "False 1\n";
+            return;
+        }
+
+        loaded->AddEdge(3, 6);
+
+        if (loaded->GetComponentsNumber() != 2 || !loaded->Connected(1, 6) || loaded->Connected(1, 4))
+        {
+            std::cout << "False 2\n";
+            return;
+        }
+
+        std::remove(path.c_str());
+
+        std::cout << "True\n";
+    }
+}
+
+void tests_merge()
+{
+    std::cout << "Tests merge:\n";
+
+    // Test 1
+    {
+        std::cout << "-- Test 1: ";
+
+        DynamicGraph first(9, 2024);
+        DynamicGraph second(9, 2024);
+
+        first.AddEdge(1, 2);
+        first.AddEdge(2, 3);
+        first.AddEdge(7, 8);
+        second.AddEdge(4, 5);
+        second.AddEdge(3, 4);
+        second.RemoveEdge(7, 8);
+
+        first.Merge(second);
+
+        std::vector<int64_t> expected = { 0, 0, 0, 0, 0, 1, 2, 3, 4 };
+
+        if (first.GetComponentLabels() != expected)
+        {
+            std::cout << "False\n";
+            return;
+        }
+
+        std::cout << "True\n";
+    }
+
+    // Test 2
+    {
+        std::cout << "-- Test 2: ";
+
+        DynamicGraph target(9, 7);
+        target.SetExactInserts(true);
+
+        std::stringstream stream;
+
+        for (int64_t part = 0; part < 3; ++part)
+        {
+            DynamicGraph partial(9, 7);
+
+            partial.AddEdge(3 * part + 1, 3 * part + 2);
+            partial.AddEdge(3 * part + 2, 3 * part + 3);
+
+            if (part == 1)
+            {
+                partial.AddEdge(1, 9);
+            }
+
+            partial.ExportSketches(stream);
+        }
+
+        for (int64_t part = 0; part < 3; ++part)
+        {
+            target.MergeSketches(stream);
+        }
+
+        if (target.GetComponentsNumber() != 2)
+        {
+            std::cout << "False 1\n";
+            return;
+        }
+
+        bool rejected = false;
+
+        try
+        {
+            target.Merge(DynamicGraph(9, 8));
+        }
+        catch (const std::invalid_argument &)
+        {
+            rejected = true;
+        }
+
+        if (!rejected)
+        {
+            std::cout << "False 2\n";
+            return;
+        }
+
+        std::cout << "True\n";
+    }
+}
+
+void tests_seeded_graphs()
+{
+    std::cout << "Tests seeded graphs:\n";
+
+    auto forest = [](uint64_t seed)
+    {
+        DynamicGraph g(16, seed);
+
+        for (auto i = 1; i < 16; ++i)
+        {
+            g.AddEdge(i, i % 5 + 1);
+            g.AddEdge(i, 16 - i / 2);
+        }
+
+        return g.GetSpanningForest();
+    };
+
+    // Test 1
+    {
+        std::cout << "-- Test 1: ";
+
+        if (forest(11) != forest(11) || DynamicGraph(4, 11).Seed() != 11)
+        {
+            std::cout << "False\n";
+            return;
+        }
+
+        std::cout << "True\n";
+    }
+
+    // Test 2
+    {
+        std::cout << "-- Test 2: ";
+
+        auto expected = forest(12);
+        std::vector< std::vector< std::pair<int64_t, int64_t> > > results(4);
+        std::vector<std::thread> threads;
+
+        for (size_t i = 0; i < results.size(); ++i)
+        {
+            threads.emplace_back([&, i]() { results[i] = forest(12); });
+        }
+
+        for (auto & thread : threads)
+        {
+            thread.join();
+        }
+
+        for (auto & result : results)
+        {
+            if (result != expected)
+            {
+                std::cout << "False\n";
+                return;
+            }
+        }
+
+        std::cout << "True\n";
+    }
+}
+
+void tests_write_ahead_log()
+{
+    std::cout << "Tests write-ahead log:\n";
+
+    std::string log_path = "wal_test.log";
+    std::string snapshot_path = "wal_test.snapshot";
+
+    std::remove(log_path.c_str());
+    std::remove(snapshot_path.c_str());
+
+    // Test 1
+    {
+        std::cout << "-- Test 1: ";
+
+        {
+            WriteAheadLog log(log_path, snapshot_path, 10, 7);
+
+            log.AddEdge(1, 2);
+            log.AddEdge(2, 3);
+            log.AddEdge(5, 6);
+            log.RemoveEdge(2, 3);
+            log.ApplyUpdates({ { 8, 9, 1 }, { 3, 4, 1 } });
+            log.Commit();
+
+            // Left to the flusher on destruction
+            log.AddEdge(9, 10);
+        }
+
+        WriteAheadLog log(log_path, snapshot_path, 10, 7);
+
+        if (log.ReplayedCount() != 7 || log.GetComponentsNumber() != 5)
+        {
+            std::cout << "False\n";
+            return;
+        }
+
+        std::cout << "True\n";
+    }
+
+    // Test 2
+    {
+        std::cout << "-- Test 2: ";
+
+        // A torn group at the end is cut off and the log goes on after it
+        {
+            std::ofstream file(log_path, std::ios::binary | std::ios::app);
+            file << "torn group";
+        }
+
+        {
+            WriteAheadLog log(log_path, snapshot_path, 10, 7);
+
+            if (log.ReplayedCount() != 7 || log.GetComponentsNumber() != 5)
+            {
+                std::cout << "False 1\n";
+                return;
+            }
+
+            log.AddEdge(6, 7);
+        }
+
+        WriteAheadLog log(log_path, snapshot_path, 10, 7);
+
+        if (log.ReplayedCount() != 8 || log.GetComponentsNumber() != 4)
+        {
+            std::cout << "False 2\n";
+            return;
+        }
+
+        std::cout << "True\n";
+    }
+
+    // Test 3
+    {
+        std::cout << "-- Test 3: ";
+
+        std::string old_log;
+
+        {
+            WriteAheadLog log(log_path, snapshot_path, 10, 7);
+
+            {
+                std::ifstream file(log_path, std::ios::binary);
+                old_log.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+            }
+
+            log.Checkpoint();
+            log.RemoveEdge(1, 2);
+        }
+
+        {
+            WriteAheadLog log(log_path, snapshot_path, 10, 7);
+
+            if (log.ReplayedCount() != 1 || log.GetComponentsNumber() != 5)
+            {
+                std::cout << "False 1\n";
+                return;
+            }
+        }
+
+        // A crash between the new snapshot and the new log leaves the old
+        // log, which the snapshot already holds
+        {
+            std::ofstream file(log_path, std::ios::binary | std::ios::trunc);
+            file << old_log;
+        }
+
+        WriteAheadLog log(log_path, snapshot_path, 10, 7);
+
+        if (log.ReplayedCount() != 0 || log.GetComponentsNumber() != 4)
+        {
+            std::cout << "False 2\n";
+            return;
+        }
+
+        std::cout << "True\n";
+    }
+
+    std::remove(log_path.c_str());
+    std::remove(snapshot_path.c_str());
+}
+
+void tests_arena()
+{
+    std::cout << "Tests arena:\n";
+
+    // Test 1
+    {
+        std::cout << "-- Test 1: ";
+
+        monotonic_arena arena(64);
+
+        for (auto round = 0; round < 3; ++round)
+        {
+            arena.reset();
+
+            std::vector< int64_t, arena_allocator<int64_t> > values{ arena_allocator<int64_t>(&arena) };
+
+            for (auto i = 0; i < 1000; ++i)
+            {
+                values.push_back(i);
+            }
+
+            void * aligned = arena.allocate(10, 64);
+
+            if (values[999] != 999 || reinterpret_cast<std::uintptr_t>(aligned) % 64 != 0)
+            {
+                std::cout << "False 1\n";
+                return;
+            }
+        }
+
+        // The first round leaves one chunk large enough for the next ones
+        size_t capacity = arena.capacity();
+
+        arena.reset();
+        arena.allocate(8000, 8);
+
+        if (arena.capacity() != capacity)
+        {
+            std::cout << "False 2\n";
+            return;
+        }
+
+        std::cout << "True\n";
+    }
+
+    // Test 2
+    {
+        std::cout << "-- Test 2: ";
+
+        DynamicGraph g(8, std::make_shared<l0sample::arena_block_allocator>(3));
+
+        for (auto i = 1; i < 8; i += 2)
+        {
+            g.AddEdge(i, i + 1);
+        }
+
+        g.AddEdge(2, 3);
+        g.RemoveEdge(1, 2);
+
+        if (g.GetComponentsNumber() != 4 || g.GetComponentsNumber() != 4)
+        {
+            std::cout << "False\n";
+            return;
+        }
+
+        std::cout << "True\n";
+    }
+}
+
+void tests_sharded_ingestor()
+{
+    std::cout << "Tests sharded ingestor:\n";
+
+    // Test 1
+    {
+        std::cout << "-- Test 1: ";
+
+        DynamicGraph g(16);
+        ShardedIngestor ingestor(g, 3);
+
+        // Two producers: one builds the path 1..8, the other the path 9..16
+        // and then cuts it in the middle
+        std::thread first([&]()
+        {
+            for (auto i = 1; i < 8; ++i)
+            {
+                ingestor.AddEdge(i, i + 1);
+            }
+        });
+
+        std::thread second([&]()
+        {
+            for (auto i = 9; i < 16; ++i)
+            {
+                ingestor.AddEdge(i + 1, i);
+            }
+
+            ingestor.RemoveEdge(12, 13);
+        });
+
+        first.join();
+        second.join();
+
+        if (ingestor.GetComponentsNumber() != 3)
+        {
+            std::cout << "False\n";
+            return;
+        }
+
+        std::cout << "True\n";
+    }
+}
+
+void tests_concurrent_dynamic_graph()
+{
+    std::cout << "Tests concurrent dynamic graph:\n";
+
+    // Test 1
+    {
+        std::cout << "-- Test 1: ";
+
+        ConcurrentDynamicGraph g(16);
+        std::vector<std::thread> threads;
+
+        // Four threads update the same star around vertex 1 at once
+        for (auto t = 0; t < 4; ++t)
+        {
+            threads.emplace_back([&g, t]()
+            {
+                for (auto i = 0; i < 50; ++i)
+                {
+                    g.AddEdge(1, 2 + t);
+                    g.RemoveEdge(2 + t, 1);
+                }
+
+                g.AddEdge(1, 2 + t);
+                g.AddEdge(6 + t, 10 + t);
+            });
+        }
+
+        for (auto & thread : threads)
+        {
+            thread.join();
+        }
+
+        if (g.GetComponentsNumber() != 8)
+        {
+            std::cout << "False\n";
+            return;
+        }
+
+        std::cout << "True\n";
+    }
+}
 
 void hard_test()
 {
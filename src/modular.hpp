@@ -0,0 +1,259 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "simd.hpp"
+
+namespace modular {
+
+    using uint128_t = unsigned __int128;
+
+    // a * b mod m without overflow for any 64-bit a, b and m > 0
+    inline uint64_t mul_mod(uint64_t a, uint64_t b, uint64_t mod)
+    {
+        if ((a | b) >> 32 == 0)
+        {
+            return a * b % mod;
+        }
+
+        return uint64_t(uint128_t(a) * b % mod);
+    }
+
+    inline uint64_t add_mod(uint64_t a, uint64_t b, uint64_t mod)
+    {
+        uint64_t result = a + b;
+
+        return result >= mod ? result - mod : result;
+    }
+
+    // values[i] = values[i] + terms[i] mod p for residues in [0, p)
+    inline void add_mod(int64_t * values, const uint64_t * terms, int64_t count, uint64_t mod)
+    {
+        auto kernel = simd::dispatch().add;
+
+        if (kernel != nullptr)
+        {
+            kernel(values, terms, count, mod);
+            return;
+        }
+
+        for (int64_t i = 0; i < count; ++i)
+        {
+            values[i] = int64_t(add_mod(uint64_t(values[i]), terms[i], mod));
+        }
+    }
+
+    // add_mod for counters shared between threads: every element is updated
+    // with a compare-and-swap, so concurrent additions are not lost
+    inline void atomic_add_mod(int64_t * values, const uint64_t * terms, int64_t count, uint64_t mod)
+    {
+        for (int64_t i = 0; i < count; ++i)
+        {
+            int64_t current = __atomic_load_n(values + i, __ATOMIC_RELAXED);
+
+            while (!__atomic_compare_exchange_n(values + i, &current,
+                       int64_t(add_mod(uint64_t(current), terms[i], mod)),
+                       true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+            }
+        }
+    }
+
+    // Representative of value in [0, mod)
+    inline uint64_t reduce(int64_t value, uint64_t mod)
+    {
+        int64_t result = value % int64_t(mod);
+
+        return uint64_t(result < 0 ? result + int64_t(mod) : result);
+    }
+
+    inline uint64_t pow_mod(uint64_t value, uint64_t p_value, uint64_t mod)
+    {
+        uint64_t result = 1 % mod;
+        value %= mod;
+
+        while (p_value != 0)
+        {
+            if (p_value & 1)
+            {
+                result = mul_mod(result, value, mod);
+            }
+
+            value = mul_mod(value, value, mod);
+            p_value >>= 1;
+        }
+
+        return result;
+    }
+
+    // Montgomery multiplication modulo an odd mod < 2^63 with R = 2^64.
+    // mul(a, b) returns a * b / R mod p, so a product of a value in Montgomery
+    // form and a plain value is a plain value.
+    class montgomery
+    {
+    public:
+        montgomery()
+            : m_mod(0), m_inverse(0), m_r2(0)
+        {
+        }
+
+        explicit montgomery(uint64_t mod)
+            : m_mod(mod)
+        {
+            // mod * mod = 1 (mod 8), every Newton step doubles the correct bits
+            uint64_t inverse = mod;
+
+            for (auto i = 0; i < 5; ++i)
+            {
+                inverse *= 2 - mod * inverse;
+            }
+
+            m_inverse = 0 - inverse;
+
+            uint64_t r = uint64_t((uint128_t(1) << 64) % mod);
+            m_r2 = uint64_t(uint128_t(r) * r % mod);
+        }
+
+        uint64_t mod() const
+        {
+            return m_mod;
+        }
+
+        uint64_t reduce(uint128_t value) const
+        {
+            uint64_t q = uint64_t(value) * m_inverse;
+            uint64_t result = uint64_t((value + uint128_t(q) * m_mod) >> 64);
+
+            return result >= m_mod ? result - m_mod : result;
+        }
+
+        uint64_t mul(uint64_t a, uint64_t b) const
+        {
+            return reduce(uint128_t(a) * b);
+        }
+
+        uint64_t to(uint64_t value) const
+        {
+            return mul(value % m_mod, m_r2);
+        }
+
+        uint64_t from(uint64_t value) const
+        {
+            return reduce(value);
+        }
+
+        uint64_t one() const
+        {
+            return to(1);
+        }
+
+    private:
+        uint64_t m_mod;
+        uint64_t m_inverse;
+        uint64_t m_r2;
+    };
+
+    // Powers z^(2^b), b < 64, of a set of evaluation points z in Montgomery
+    // form, laid out as [bit][point]: z^e costs one multiplication per set bit of e.
+    // When the CPU has a vector kernel and the modulus is small enough for it,
+    // the table is also kept as plain residues in doubles for that kernel.
+    class power_table
+    {
+    public:
+        static constexpr int64_t bits = 64;
+
+        power_table()
+            : m_count(0), m_kernel(nullptr)
+        {
+        }
+
+        power_table(uint64_t mod, const std::vector<int64_t> & points)
+            : m_field(mod), m_count(int64_t(points.size())), m_table(bits * points.size()),
+            m_kernel(mod < simd::max_float_mod ? simd::dispatch().powers : nullptr)
+        {
+            for (int64_t i = 0; i < m_count; ++i)
+            {
+                uint64_t power = m_field.to(uint64_t(points[i]));
+
+                for (int64_t b = 0; b < bits; ++b)
+                {
+                    m_table[b * m_count + i] = power;
+                    power = m_field.mul(power, power);
+                }
+            }
+
+            if (m_kernel != nullptr)
+            {
+                for (auto power : m_table)
+                {
+                    m_float_table.push_back(double(m_field.from(power)));
+                }
+            }
+        }
+
+        const montgomery & field() const
+        {
+            return m_field;
+        }
+
+        int64_t count() const
+        {
+            return m_count;
+        }
+
+        // value * z^p_value mod p for one point; value must be in [0, p)
+        uint64_t scaled_power(int64_t point, uint64_t p_value, uint64_t value) const
+        {
+            uint64_t result = m_field.one();
+
+            for (; p_value != 0; p_value &= p_value - 1)
+            {
+                result = m_field.mul(result, m_table[__builtin_ctzll(p_value) * m_count + point]);
+            }
+
+            return m_field.mul(result, value);
+        }
+
+        // result[i] = value * z_{first + i}^p_value mod p for count points
+        void scaled_powers(uint64_t p_value, uint64_t value,
+                           int64_t first, int64_t count, uint64_t * result) const
+        {
+            if (m_kernel != nullptr)
+            {
+                m_kernel(m_float_table.data() + first, m_count, p_value,
+                         double(value), double(m_field.mod()), count, result);
+                return;
+            }
+
+            uint64_t one = m_field.one();
+
+            for (int64_t i = 0; i < count; ++i)
+            {
+                result[i] = one;
+            }
+
+            for (; p_value != 0; p_value &= p_value - 1)
+            {
+                const uint64_t * row = m_table.data() + __builtin_ctzll(p_value) * m_count + first;
+
+                for (int64_t i = 0; i < count; ++i)
+                {
+                    result[i] = m_field.mul(result[i], row[i]);
+                }
+            }
+
+            for (int64_t i = 0; i < count; ++i)
+            {
+                result[i] = m_field.mul(result[i], value);
+            }
+        }
+
+    private:
+        montgomery m_field;
+        int64_t m_count;
+        std::vector<uint64_t> m_table;
+        std::vector<double> m_float_table;
+        simd::powers_kernel m_kernel;
+    };
+}
@@ -0,0 +1,178 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "bounded_queue.hpp"
+#include "dynamic_graph.hpp"
+
+// Multithreaded ingestion into a DynamicGraph. Vertices are split between
+// worker_count workers (vertex v belongs to worker v % worker_count) and
+// every worker is the only writer of the sketches of its vertices. An edge
+// update is split into the updates of its two endpoints, which producers
+// route to the owners through lock-free queues, so the sketch counters need
+// no locking. AddEdge, RemoveEdge and ApplyUpdates may be called from any
+// number of threads; the graph itself must not be used until Drain returns.
+class ShardedIngestor
+{
+public:
+    ShardedIngestor(DynamicGraph & graph, size_t worker_count, size_t queue_capacity = 1 << 12)
+        : m_graph(graph), m_pending(0), m_stop(false)
+    {
+        worker_count = worker_count == 0 ? 1 : worker_count;
+
+        for (size_t i = 0; i < worker_count; ++i)
+        {
+            m_queues.emplace_back(new bounded_queue<DynamicGraph::endpoint_update>(queue_capacity));
+        }
+
+        for (size_t i = 0; i < worker_count; ++i)
+        {
+            m_workers.emplace_back([this, i]() { work(i); });
+        }
+    }
+
+    ShardedIngestor(const ShardedIngestor &) = delete;
+    ShardedIngestor & operator=(const ShardedIngestor &) = delete;
+
+    ~ShardedIngestor()
+    {
+        Drain();
+
+        m_stop.store(true, std::memory_order_release);
+
+        for (auto & worker : m_workers)
+        {
+            worker.join();
+        }
+    }
+
+    void AddEdge(int64_t u, int64_t v)
+    {
+        update_edge(u, v, +1);
+    }
+
+    void RemoveEdge(int64_t u, int64_t v)
+    {
+        update_edge(u, v, -1);
+    }
+
+    void ApplyUpdates(const EdgeUpdate * updates, size_t count)
+    {
+        for (size_t i = 0; i < count; ++i)
+        {
+            update_edge(updates[i].u, updates[i].v, updates[i].delta);
+        }
+    }
+
+    void ApplyUpdates(const std::vector<EdgeUpdate> & updates)
+    {
+        ApplyUpdates(updates.data(), updates.size());
+    }
+
+    // Waits until every update pushed so far is in the sketches
+    void Drain()
+    {
+        while (m_pending.load(std::memory_order_acquire) != 0)
+        {
+            std::this_thread::yield();
+        }
+    }
+
+    int64_t GetComponentsNumber()
+    {
+        Drain();
+
+        return m_graph.GetComponentsNumber();
+    }
+
+private:
+    // Endpoint updates a worker takes from its queue at once
+    static constexpr size_t worker_batch = 64;
+
+    // Empty polls before an idle worker starts sleeping between polls
+    static constexpr size_t idle_spins = 64;
+
+    void update_edge(int64_t u, int64_t v, int64_t delta)
+    {
+        if (u > v) std::swap(u, v);
+
+        u--;
+        v--;
+
+        int64_t edge_number = u * m_graph.VertexCount() + v;
+
+        m_pending.fetch_add(2, std::memory_order_relaxed);
+
+        push({ u, edge_number, delta, false });
+        push({ v, edge_number, delta, true });
+    }
+
+    void push(const DynamicGraph::endpoint_update & update)
+    {
+        auto & queue = *m_queues[size_t(update.vertex) % m_queues.size()];
+
+        while (!queue.try_push(update))
+        {
+            std::this_thread::yield();
+        }
+    }
+
+    void work(size_t worker)
+    {
+        auto & queue = *m_queues[worker];
+
+        std::vector<DynamicGraph::endpoint_update> batch;
+        l0sample::update_plan plan;
+        size_t idle = 0;
+
+        for (;;)
+        {
+            DynamicGraph::endpoint_update update;
+
+            batch.clear();
+
+            while (batch.size() < worker_batch && queue.try_pop(update))
+            {
+                batch.push_back(update);
+            }
+
+            if (batch.empty())
+            {
+                if (m_stop.load(std::memory_order_acquire))
+                {
+                    return;
+                }
+
+                if (++idle < idle_spins)
+                {
+                    std::this_thread::yield();
+                }
+                else
+                {
+                    std::this_thread::sleep_for(std::chrono::microseconds(50));
+                }
+
+                continue;
+            }
+
+            idle = 0;
+
+            m_graph.apply_endpoints(batch.data(), batch.size(), plan);
+            m_pending.fetch_sub(int64_t(batch.size()), std::memory_order_release);
+        }
+    }
+
+private:
+    DynamicGraph & m_graph;
+
+    std::vector< std::unique_ptr< bounded_queue<DynamicGraph::endpoint_update> > > m_queues;
+    std::vector<std::thread> m_workers;
+
+    std::atomic<int64_t> m_pending;
+    std::atomic<bool> m_stop;
+};
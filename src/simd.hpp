@@ -0,0 +1,238 @@
+#pragma once
+
+#include <cstdint>
+#include <cmath>
+
+#if defined(DYNAMIC_GRAPH_SIMD) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DYNAMIC_GRAPH_SIMD_X86
+#include <immintrin.h>
+#endif
+
+// Vectorized fingerprint kernels. The products are computed in double
+// precision: for residues below 2^50 the high part of a * b is rounded,
+// the low part is recovered exactly with a fused multiply-add and the
+// quotient estimate is off by at most one, so the result is exact.
+namespace simd {
+
+    constexpr uint64_t max_float_mod = uint64_t(1) << 50;
+
+    // result[i] = value * prod table[b * stride + i] mod p over the set bits b
+    // of p_value, for i < count; table and value hold residues below max_float_mod
+    using powers_kernel = void (*)(const double * table, int64_t stride, uint64_t p_value,
+                                   double value, double mod, int64_t count, uint64_t * result);
+
+    // values[i] = values[i] + terms[i] mod p for residues in [0, p), p < 2^62
+    using add_kernel = void (*)(int64_t * values, const uint64_t * terms,
+                                int64_t count, uint64_t mod);
+
+    struct kernels
+    {
+        powers_kernel powers;
+        add_kernel add;
+    };
+
+    inline double mul_mod(double a, double b, double mod, double inverse)
+    {
+        double high = a * b;
+        double low = std::fma(a, b, -high);
+        double result = std::fma(-std::floor(high * inverse), mod, high) + low;
+
+        result += result < 0 ? mod : 0;
+
+        return result >= mod ? result - mod : result;
+    }
+
+    inline void powers_scalar(const double * table, int64_t stride, uint64_t p_value,
+                              double value, double mod, int64_t count, uint64_t * result)
+    {
+        double inverse = 1. / mod;
+
+        for (int64_t i = 0; i < count; ++i)
+        {
+            double power = 1.;
+
+            for (uint64_t bits = p_value; bits != 0; bits &= bits - 1)
+            {
+                power = mul_mod(power, table[__builtin_ctzll(bits) * stride + i], mod, inverse);
+            }
+
+            result[i] = uint64_t(mul_mod(power, value, mod, inverse));
+        }
+    }
+
+#ifdef DYNAMIC_GRAPH_SIMD_X86
+
+    __attribute__((target("avx2,fma")))
+    inline __m256d mul_mod_avx2(__m256d a, __m256d b, __m256d mod, __m256d inverse)
+    {
+        __m256d high = _mm256_mul_pd(a, b);
+        __m256d low = _mm256_fmsub_pd(a, b, high);
+        __m256d quotient = _mm256_floor_pd(_mm256_mul_pd(high, inverse));
+        __m256d result = _mm256_add_pd(_mm256_fnmadd_pd(quotient, mod, high), low);
+
+        __m256d negative = _mm256_cmp_pd(result, _mm256_setzero_pd(), _CMP_LT_OQ);
+        result = _mm256_add_pd(result, _mm256_and_pd(negative, mod));
+
+        __m256d overflow = _mm256_cmp_pd(result, mod, _CMP_GE_OQ);
+
+        return _mm256_sub_pd(result, _mm256_and_pd(overflow, mod));
+    }
+
+    __attribute__((target("avx2,fma")))
+    inline void powers_avx2(const double * table, int64_t stride, uint64_t p_value,
+                            double value, double mod, int64_t count, uint64_t * result)
+    {
+        // x + 2^52 has the bits of 2^52 + x for integral x in [0, 2^52)
+        const __m256d magic = _mm256_set1_pd(4503599627370496.);
+        const __m256d modv = _mm256_set1_pd(mod);
+        const __m256d inverse = _mm256_set1_pd(1. / mod);
+        const __m256d scale = _mm256_set1_pd(value);
+
+        for (int64_t i = 0; i < count; i += 4)
+        {
+            // Lanes past count are masked out of every load and store
+            __m256i mask = _mm256_cmpgt_epi64(_mm256_set1_epi64x(count - i),
+                                              _mm256_setr_epi64x(0, 1, 2, 3));
+            __m256d power = _mm256_set1_pd(1.);
+
+            for (uint64_t bits = p_value; bits != 0; bits &= bits - 1)
+            {
+                __m256d row = _mm256_maskload_pd(table + __builtin_ctzll(bits) * stride + i, mask);
+                power = mul_mod_avx2(power, row, modv, inverse);
+            }
+
+            power = _mm256_add_pd(mul_mod_avx2(power, scale, modv, inverse), magic);
+
+            _mm256_maskstore_epi64(reinterpret_cast<long long *>(result + i), mask,
+                _mm256_sub_epi64(_mm256_castpd_si256(power), _mm256_castpd_si256(magic)));
+        }
+    }
+
+    __attribute__((target("avx2")))
+    inline void add_avx2(int64_t * values, const uint64_t * terms, int64_t count, uint64_t mod)
+    {
+        const __m256i modv = _mm256_set1_epi64x(int64_t(mod));
+        const __m256i limit = _mm256_set1_epi64x(int64_t(mod) - 1);
+
+        int64_t i = 0;
+
+        for (; i + 4 <= count; i += 4)
+        {
+            __m256i * target = reinterpret_cast<__m256i *>(values + i);
+            __m256i sum = _mm256_add_epi64(_mm256_loadu_si256(target),
+                _mm256_loadu_si256(reinterpret_cast<const __m256i *>(terms + i)));
+
+            __m256i overflow = _mm256_cmpgt_epi64(sum, limit);
+            _mm256_storeu_si256(target, _mm256_sub_epi64(sum, _mm256_and_si256(overflow, modv)));
+        }
+
+        for (; i < count; ++i)
+        {
+            uint64_t sum = uint64_t(values[i]) + terms[i];
+            values[i] = int64_t(sum >= mod ? sum - mod : sum);
+        }
+    }
+
+    __attribute__((target("avx512f")))
+    inline __m512d mul_mod_avx512(__m512d a, __m512d b, __m512d mod, __m512d inverse)
+    {
+        __m512d high = _mm512_mul_pd(a, b);
+        __m512d low = _mm512_fmsub_pd(a, b, high);
+        __m512d quotient = _mm512_maskz_roundscale_pd(0xff, _mm512_mul_pd(high, inverse),
+                                                      _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+        __m512d result = _mm512_add_pd(_mm512_fnmadd_pd(quotient, mod, high), low);
+
+        __mmask8 negative = _mm512_cmp_pd_mask(result, _mm512_setzero_pd(), _CMP_LT_OQ);
+        result = _mm512_mask_add_pd(result, negative, result, mod);
+
+        __mmask8 overflow = _mm512_cmp_pd_mask(result, mod, _CMP_GE_OQ);
+
+        return _mm512_mask_sub_pd(result, overflow, result, mod);
+    }
+
+    __attribute__((target("avx512f")))
+    inline void powers_avx512(const double * table, int64_t stride, uint64_t p_value,
+                              double value, double mod, int64_t count, uint64_t * result)
+    {
+        const __m512d magic = _mm512_set1_pd(4503599627370496.);
+        const __m512d modv = _mm512_set1_pd(mod);
+        const __m512d inverse = _mm512_set1_pd(1. / mod);
+        const __m512d scale = _mm512_set1_pd(value);
+
+        for (int64_t i = 0; i < count; i += 8)
+        {
+            // Lanes past count are masked out of every load and store
+            __mmask8 mask = count - i >= 8 ? 0xff : __mmask8((1u << (count - i)) - 1);
+            __m512d power = _mm512_set1_pd(1.);
+
+            for (uint64_t bits = p_value; bits != 0; bits &= bits - 1)
+            {
+                __m512d row = _mm512_maskz_loadu_pd(mask, table + __builtin_ctzll(bits) * stride + i);
+                power = mul_mod_avx512(power, row, modv, inverse);
+            }
+
+            power = _mm512_add_pd(mul_mod_avx512(power, scale, modv, inverse), magic);
+
+            _mm512_mask_storeu_epi64(result + i, mask,
+                _mm512_sub_epi64(_mm512_castpd_si512(power), _mm512_castpd_si512(magic)));
+        }
+    }
+
+    __attribute__((target("avx512f")))
+    inline void add_avx512(int64_t * values, const uint64_t * terms, int64_t count, uint64_t mod)
+    {
+        const __m512i modv = _mm512_set1_epi64(int64_t(mod));
+
+        int64_t i = 0;
+
+        for (; i + 8 <= count; i += 8)
+        {
+            __m512i sum = _mm512_add_epi64(_mm512_loadu_si512(values + i),
+                                           _mm512_loadu_si512(terms + i));
+
+            __mmask8 overflow = _mm512_cmpge_epu64_mask(sum, modv);
+            _mm512_storeu_si512(values + i, _mm512_mask_sub_epi64(sum, overflow, sum, modv));
+        }
+
+        for (; i < count; ++i)
+        {
+            uint64_t sum = uint64_t(values[i]) + terms[i];
+            values[i] = int64_t(sum >= mod ? sum - mod : sum);
+        }
+    }
+
+    inline bool cpu_supports_avx2()
+    {
+        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    }
+
+    inline bool cpu_supports_avx512()
+    {
+        return __builtin_cpu_supports("avx512f");
+    }
+
+#endif
+
+    // Best kernels for the running CPU; null members mean the scalar
+    // Montgomery code should be used
+    inline const kernels & dispatch()
+    {
+        static const kernels result = []()
+        {
+#ifdef DYNAMIC_GRAPH_SIMD_X86
+            if (cpu_supports_avx512())
+            {
+                return kernels{ powers_avx512, add_avx512 };
+            }
+
+            if (cpu_supports_avx2())
+            {
+                return kernels{ powers_avx2, add_avx2 };
+            }
+#endif
+            return kernels{ nullptr, nullptr };
+        }();
+
+        return result;
+    }
+}
@@ -0,0 +1,135 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of threads running parallel loops: the thread calling
+// parallel_for takes part as worker 0, the others wait between loops.
+class thread_pool
+{
+public:
+    explicit thread_pool(size_t thread_count)
+        : m_thread_count(std::max<size_t>(1, thread_count)),
+        m_task(nullptr), m_count(0), m_next(0), m_busy(0), m_generation(0), m_stop(false)
+    {
+        for (size_t i = 1; i < m_thread_count; ++i)
+        {
+            m_workers.emplace_back([this, i]() { work(i); });
+        }
+    }
+
+    thread_pool(const thread_pool &) = delete;
+    thread_pool & operator=(const thread_pool &) = delete;
+
+    ~thread_pool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+
+        m_wake.notify_all();
+
+        for (auto & worker : m_workers)
+        {
+            worker.join();
+        }
+    }
+
+    size_t size() const
+    {
+        return m_thread_count;
+    }
+
+    // Calls task(worker, index) for every index in [0, count). worker is below
+    // size() and identifies the thread, so tasks can keep per-thread scratch.
+    void parallel_for(int64_t count, const std::function<void(size_t, int64_t)> & task)
+    {
+        if (m_thread_count == 1 || count <= 1)
+        {
+            for (int64_t i = 0; i < count; ++i)
+            {
+                task(0, i);
+            }
+
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+
+            m_task = &task;
+            m_count = count;
+            m_next = 0;
+            m_busy = m_thread_count - 1;
+            ++m_generation;
+        }
+
+        m_wake.notify_all();
+
+        run(0);
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_done.wait(lock, [this]() { return m_busy == 0; });
+        m_task = nullptr;
+    }
+
+private:
+    void run(size_t worker)
+    {
+        for (int64_t i = m_next++; i < m_count; i = m_next++)
+        {
+            (*m_task)(worker, i);
+        }
+    }
+
+    void work(size_t worker)
+    {
+        uint64_t generation = 0;
+
+        for (;;)
+        {
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_wake.wait(lock, [&]() { return m_stop || m_generation != generation; });
+
+                if (m_stop)
+                {
+                    return;
+                }
+
+                generation = m_generation;
+            }
+
+            run(worker);
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+
+            if (--m_busy == 0)
+            {
+                m_done.notify_one();
+            }
+        }
+    }
+
+private:
+    const size_t m_thread_count;
+    std::vector<std::thread> m_workers;
+
+    const std::function<void(size_t, int64_t)> * m_task;
+    int64_t m_count;
+    std::atomic<int64_t> m_next;
+    size_t m_busy;
+    uint64_t m_generation;
+    bool m_stop;
+
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::condition_variable m_done;
+};
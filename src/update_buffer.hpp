@@ -0,0 +1,121 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "dynamic_graph.hpp"
+
+// Write buffer in front of a DynamicGraph. It keeps the net multiplicity of
+// every edge with pending updates and hands only the nonzero ones to
+// DynamicGraph::ApplyUpdates: when the number of buffered edges reaches
+// max_edges, when the oldest pending update is older than max_delay, before
+// a query and on destruction. The age is checked on the next update and on
+// Poll, so a caller whose updates may pause drives Poll from a timer. An
+// edge added and removed between two flushes never touches the sketches.
+class UpdateBuffer
+{
+public:
+    explicit UpdateBuffer(DynamicGraph & graph, size_t max_edges = 1 << 16,
+                          std::chrono::milliseconds max_delay = std::chrono::milliseconds(100))
+        : m_graph(graph), m_max_edges(max_edges), m_max_delay(max_delay)
+    {
+        m_pending.reserve(m_max_edges);
+    }
+
+    UpdateBuffer(const UpdateBuffer &) = delete;
+    UpdateBuffer & operator=(const UpdateBuffer &) = delete;
+
+    ~UpdateBuffer()
+    {
+        Flush();
+    }
+
+    void AddEdge(int64_t u, int64_t v)
+    {
+        update_edge(u, v, +1);
+    }
+
+    void RemoveEdge(int64_t u, int64_t v)
+    {
+        update_edge(u, v, -1);
+    }
+
+    // Number of edges with pending updates, including those that cancelled out
+    size_t Size() const
+    {
+        return m_pending.size();
+    }
+
+    void Flush()
+    {
+        if (m_pending.empty())
+        {
+            return;
+        }
+
+        int64_t vertex_count = m_graph.VertexCount();
+
+        m_updates.clear();
+
+        for (auto & pending : m_pending)
+        {
+            if (pending.second != 0)
+            {
+                m_updates.push_back({ pending.first / vertex_count + 1,
+                                      pending.first % vertex_count + 1, pending.second });
+            }
+        }
+
+        m_pending.clear();
+        m_graph.ApplyUpdates(m_updates);
+    }
+
+    // Flushes when the oldest pending update is older than max_delay
+    void Poll()
+    {
+        if (!m_pending.empty() && std::chrono::steady_clock::now() - m_oldest >= m_max_delay)
+        {
+            Flush();
+        }
+    }
+
+    int64_t GetComponentsNumber()
+    {
+        Flush();
+
+        return m_graph.GetComponentsNumber();
+    }
+
+private:
+    void update_edge(int64_t u, int64_t v, int64_t delta)
+    {
+        if (u > v) std::swap(u, v);
+
+        if (m_pending.empty())
+        {
+            m_oldest = std::chrono::steady_clock::now();
+        }
+
+        m_pending[(u - 1) * m_graph.VertexCount() + (v - 1)] += delta;
+
+        if (m_pending.size() >= m_max_edges)
+        {
+            Flush();
+        }
+        else
+        {
+            Poll();
+        }
+    }
+
+private:
+    DynamicGraph & m_graph;
+    const size_t m_max_edges;
+    const std::chrono::milliseconds m_max_delay;
+
+    std::chrono::steady_clock::time_point m_oldest;
+    std::unordered_map<int64_t, int64_t> m_pending;
+    std::vector<EdgeUpdate> m_updates;
+};
@@ -0,0 +1,512 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "dynamic_graph.hpp"
+
+// Readers of update streams: the text format of simple_test
+//
+//     n count
+//     + u v
+//     - u v
+//     ?
+//
+// and a compact binary one. A binary stream starts with the magic "DGUB",
+// a little endian uint32 version and a little endian uint64 vertex count;
+// every record is then a tag byte (0 add, 1 remove, 2 query) followed, for
+// an update, by u as a zigzag varint delta from the u of the previous
+// update and by v as a zigzag varint delta from u. Both readers work on a
+// buffer in memory, usually a MappedFile, and never copy it; the text
+// reader also reads a pipe through a small refilled buffer.
+
+// Operation of a stream: '+' u v, '-' u v or '?'
+struct StreamUpdate
+{
+    char op;
+    int64_t u;
+    int64_t v;
+};
+
+// Read-only memory mapping of a whole file
+class MappedFile
+{
+public:
+    explicit MappedFile(const std::string & path)
+        : m_data(nullptr), m_size(0)
+    {
+        int fd = ::open(path.c_str(), O_RDONLY);
+
+        if (fd < 0)
+        {
+            throw std::runtime_error("cannot open " + path);
+        }
+
+        try
+        {
+            map(fd, path);
+        }
+        catch (...)
+        {
+            ::close(fd);
+            throw;
+        }
+
+        ::close(fd);
+    }
+
+    // Maps the regular file open as fd, e.g. a redirected stdin; fd stays open
+    explicit MappedFile(int fd)
+        : m_data(nullptr), m_size(0)
+    {
+        map(fd, "descriptor " + std::to_string(fd));
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile & operator=(const MappedFile &) = delete;
+
+    ~MappedFile()
+    {
+        if (m_data != nullptr)
+        {
+            ::munmap(const_cast<char *>(m_data), m_size);
+        }
+    }
+
+    const char * Data() const
+    {
+        return m_data;
+    }
+
+    size_t Size() const
+    {
+        return m_size;
+    }
+
+private:
+    void map(int fd, const std::string & name)
+    {
+        struct stat status;
+
+        if (::fstat(fd, &status) != 0)
+        {
+            throw std::runtime_error("cannot stat " + name);
+        }
+
+        m_size = size_t(status.st_size);
+
+        if (m_size > 0)
+        {
+            void * data = ::mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+            if (data == MAP_FAILED)
+            {
+                throw std::runtime_error("cannot map " + name);
+            }
+
+            // The readers go through the file once, front to back
+            ::madvise(data, m_size, MADV_SEQUENTIAL);
+            m_data = static_cast<const char *>(data);
+        }
+    }
+
+private:
+    const char * m_data;
+    size_t m_size;
+};
+
+// true when fd is a regular file, which MappedFile can map
+inline bool IsRegularFile(int fd)
+{
+    struct stat status;
+
+    return ::fstat(fd, &status) == 0 && S_ISREG(status.st_mode);
+}
+
+class TextUpdateReader
+{
+public:
+    TextUpdateReader(const char * data, size_t size)
+        : m_position(data), m_end(data + size), m_fd(-1)
+    {
+        m_vertex_count = read_number();
+        m_remaining = read_number();
+    }
+
+    // Reads a stream which cannot be mapped, such as a pipe, through a buffer
+    // refilled with what is available, so a request is answered before the
+    // next one is read
+    explicit TextUpdateReader(int fd, size_t buffer_size = 1 << 16)
+        : m_position(nullptr), m_end(nullptr), m_fd(fd), m_buffer(buffer_size)
+    {
+        m_vertex_count = read_number();
+        m_remaining = read_number();
+    }
+
+    int64_t VertexCount() const
+    {
+        return m_vertex_count;
+    }
+
+    // false after the number of requests of the header
+    bool Next(StreamUpdate & update)
+    {
+        if (m_remaining == 0)
+        {
+            return false;
+        }
+
+        skip_spaces();
+
+        if (at_end())
+        {
+            throw std::runtime_error("update stream ends early");
+        }
+
+        update.op = *m_position++;
+
+        if (update.op == '+' || update.op == '-')
+        {
+            update.u = read_number();
+            update.v = read_number();
+        }
+        else
+        {
+            // Any other operation is a query, as in simple_test
+            update.op = '?';
+        }
+
+        --m_remaining;
+
+        return true;
+    }
+
+private:
+    // Refills the buffer of a descriptor when it is used up
+    bool at_end()
+    {
+        if (m_position != m_end)
+        {
+            return false;
+        }
+
+        if (m_fd < 0)
+        {
+            return true;
+        }
+
+        ssize_t size;
+
+        do
+        {
+            size = ::read(m_fd, m_buffer.data(), m_buffer.size());
+        }
+        while (size < 0 && errno == EINTR);
+
+        if (size < 0)
+        {
+            throw std::runtime_error(std::string("cannot read update stream: ") + std::strerror(errno));
+        }
+
+        m_position = m_buffer.data();
+        m_end = m_position + size;
+
+        return size == 0;
+    }
+
+    void skip_spaces()
+    {
+        while (!at_end() && static_cast<unsigned char>(*m_position) <= ' ')
+        {
+            ++m_position;
+        }
+    }
+
+    int64_t read_number()
+    {
+        skip_spaces();
+
+        if (at_end() || unsigned(*m_position - '0') > 9)
+        {
+            throw std::runtime_error("number expected in update stream");
+        }
+
+        int64_t result = 0;
+
+        while (!at_end() && unsigned(*m_position - '0') <= 9)
+        {
+            result = result * 10 + (*m_position++ - '0');
+        }
+
+        return result;
+    }
+
+private:
+    const char * m_position;
+    const char * m_end;
+    int m_fd;
+    std::vector<char> m_buffer;
+    int64_t m_vertex_count;
+    int64_t m_remaining;
+};
+
+namespace binary_stream
+{
+    constexpr char magic[4] = { 'D', 'G', 'U', 'B' };
+    constexpr uint32_t version = 1;
+    constexpr size_t header_size = 16;
+
+    enum tag : uint8_t
+    {
+        add = 0,
+        remove = 1,
+        query = 2
+    };
+
+    inline uint64_t zigzag(int64_t value)
+    {
+        return (uint64_t(value) << 1) ^ uint64_t(value >> 63);
+    }
+
+    inline int64_t unzigzag(uint64_t value)
+    {
+        return int64_t(value >> 1) ^ -int64_t(value & 1);
+    }
+
+    // Longest record: the tag and two varints of up to ten bytes
+    constexpr size_t max_record_size = 21;
+
+    inline size_t put_varint(char * target, uint64_t value)
+    {
+        size_t size = 0;
+
+        while (value >= 0x80)
+        {
+            target[size++] = char(value | 0x80);
+            value >>= 7;
+        }
+
+        target[size++] = char(value);
+
+        return size;
+    }
+
+    inline uint64_t get_varint(const uint8_t *& position, const uint8_t * end)
+    {
+        uint64_t result = 0;
+
+        for (int shift = 0; shift < 64; shift += 7)
+        {
+            if (position == end)
+            {
+                break;
+            }
+
+            uint8_t byte = *position++;
+
+            result |= uint64_t(byte & 0x7f) << shift;
+
+            if (byte < 0x80)
+            {
+                return result;
+            }
+        }
+
+        throw std::runtime_error("truncated binary update stream");
+    }
+
+    // Writes the record of update to target and returns its size; last_u is
+    // the u of the previous update of the stream and is advanced
+    inline size_t encode(char * target, const StreamUpdate & update, int64_t & last_u)
+    {
+        size_t size = 0;
+
+        if (update.op == '?')
+        {
+            target[size++] = char(query);
+        }
+        else
+        {
+            target[size++] = char(update.op == '+' ? add : remove);
+            size += put_varint(target + size, zigzag(update.u - last_u));
+            size += put_varint(target + size, zigzag(update.v - update.u));
+
+            last_u = update.u;
+        }
+
+        return size;
+    }
+
+    // Reads the record at position, which must be before end, and moves
+    // position past it
+    inline void decode(const uint8_t *& position, const uint8_t * end, StreamUpdate & update, int64_t & last_u)
+    {
+        uint8_t tag = *position++;
+
+        if (tag == query)
+        {
+            update.op = '?';
+
+            return;
+        }
+
+        if (tag > remove)
+        {
+            throw std::runtime_error("unknown record in binary update stream");
+        }
+
+        update.op = tag == add ? '+' : '-';
+        update.u = last_u + unzigzag(get_varint(position, end));
+        update.v = update.u + unzigzag(get_varint(position, end));
+
+        last_u = update.u;
+    }
+} // binary_stream
+
+class BinaryUpdateWriter
+{
+public:
+    BinaryUpdateWriter(std::ostream & output, int64_t vertex_count)
+        : m_output(output), m_last_u(0)
+    {
+        char header[binary_stream::header_size];
+
+        std::memcpy(header, binary_stream::magic, 4);
+        store(header + 4, binary_stream::version, 4);
+        store(header + 8, uint64_t(vertex_count), 8);
+
+        m_output.write(header, sizeof(header));
+    }
+
+    void Write(const StreamUpdate & update)
+    {
+        char record[binary_stream::max_record_size];
+        size_t size = binary_stream::encode(record, update, m_last_u);
+
+        m_output.write(record, std::streamsize(size));
+    }
+
+private:
+    static void store(char * target, uint64_t value, size_t bytes)
+    {
+        for (size_t i = 0; i < bytes; ++i)
+        {
+            target[i] = char(value >> (8 * i));
+        }
+    }
+
+private:
+    std::ostream & m_output;
+    int64_t m_last_u;
+};
+
+class BinaryUpdateReader
+{
+public:
+    BinaryUpdateReader(const char * data, size_t size)
+        : m_position(reinterpret_cast<const uint8_t *>(data)),
+        m_end(reinterpret_cast<const uint8_t *>(data) + size), m_last_u(0)
+    {
+        if (size < binary_stream::header_size || std::memcmp(data, binary_stream::magic, 4) != 0)
+        {
+            throw std::runtime_error("not a binary update stream");
+        }
+
+        if (load(m_position + 4, 4) != binary_stream::version)
+        {
+            throw std::runtime_error("unsupported binary update stream version");
+        }
+
+        m_vertex_count = int64_t(load(m_position + 8, 8));
+        m_position += binary_stream::header_size;
+    }
+
+    int64_t VertexCount() const
+    {
+        return m_vertex_count;
+    }
+
+    // false at the end of the buffer
+    bool Next(StreamUpdate & update)
+    {
+        if (m_position == m_end)
+        {
+            return false;
+        }
+
+        binary_stream::decode(m_position, m_end, update, m_last_u);
+
+        return true;
+    }
+
+private:
+    static uint64_t load(const uint8_t * source, size_t bytes)
+    {
+        uint64_t result = 0;
+
+        for (size_t i = 0; i < bytes; ++i)
+        {
+            result |= uint64_t(source[i]) << (8 * i);
+        }
+
+        return result;
+    }
+
+private:
+    const uint8_t * m_position;
+    const uint8_t * m_end;
+    int64_t m_vertex_count;
+    int64_t m_last_u;
+};
+
+// Applies the updates of a reader to the graph through ApplyUpdates, in
+// batches which end at every query and at batch_size updates, and passes
+// the answer of every query to on_query. Returns the number of records.
+template <typename Reader>
+int64_t ReplayUpdates(DynamicGraph & graph, Reader & reader,
+                      const std::function<void(int64_t)> & on_query, size_t batch_size = 1 << 16)
+{
+    std::vector<EdgeUpdate> batch;
+    StreamUpdate update;
+    int64_t count = 0;
+
+    batch.reserve(batch_size);
+
+    while (reader.Next(update))
+    {
+        ++count;
+
+        if (update.op == '?')
+        {
+            graph.ApplyUpdates(batch);
+            batch.clear();
+
+            on_query(graph.GetComponentsNumber());
+        }
+        else
+        {
+            batch.push_back({ update.u, update.v, update.op == '+' ? 1 : -1 });
+
+            if (batch.size() == batch_size)
+            {
+                graph.ApplyUpdates(batch);
+                batch.clear();
+            }
+        }
+    }
+
+    graph.ApplyUpdates(batch);
+
+    return count;
+}
@@ -0,0 +1,556 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "dynamic_graph.hpp"
+#include "update_stream.hpp"
+
+// Durable ingestion into a DynamicGraph: every update is appended to a log
+// before it reaches the sketches, and the log goes to disk in groups. A
+// background thread writes and syncs the updates collected so far once
+// commit_delay has passed or commit_bytes are waiting, so a sync covers
+// thousands of updates instead of one. Commit waits until every update
+// before it is durable.
+//
+// The log builds on a snapshot of DynamicGraph::Save. Checkpoint saves the
+// graph and starts an empty log on top of the new snapshot; on construction
+// the snapshot is loaded and the log replayed into it.
+//
+// A log starts with a write_ahead::header, whose base is the header_checksum
+// of the snapshot it builds on (0 for an empty graph), followed by groups: a
+// write_ahead::group_header and the records of binary_stream, padded with
+// zeros to whole 64-bit words. A group whose checksum does not match is the
+// torn tail of a crash; it and everything after it is cut off.
+//
+// AddEdge, RemoveEdge, ApplyUpdates, Commit and Checkpoint are called from a
+// single thread, like the methods of DynamicGraph.
+namespace write_ahead
+{
+    constexpr char magic[8] = { 'D', 'G', 'W', 'A', 'L', 0, 0, 0 };
+    constexpr uint32_t version = 1;
+
+    struct header
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t header_size;
+
+        int64_t vertex_count;
+        uint64_t base;
+
+        uint64_t header_checksum;
+    };
+
+    struct group_header
+    {
+        uint64_t payload_size;  // bytes of records, without the padding
+        uint64_t record_count;
+        uint64_t checksum;      // of the sizes and the padded records
+    };
+
+    inline uint64_t group_checksum(const group_header & head, const char * payload)
+    {
+        return snapshot::checksum(payload, snapshot::round_up(head.payload_size, sizeof(uint64_t)) / sizeof(uint64_t),
+                                  snapshot::checksum(&head, 2, 0));
+    }
+
+    // Header checksum of the snapshot at path, 0 when there is none
+    inline uint64_t snapshot_id(const std::string & path)
+    {
+        int fd = ::open(path.c_str(), O_RDONLY);
+
+        if (fd < 0)
+        {
+            if (errno == ENOENT)
+            {
+                return 0;
+            }
+
+            throw std::runtime_error("cannot open snapshot " + path);
+        }
+
+        snapshot::header head;
+        ssize_t read = ::pread(fd, &head, sizeof(head), 0);
+
+        ::close(fd);
+
+        if (read != ssize_t(sizeof(head)) || std::memcmp(head.magic, snapshot::magic, sizeof(head.magic)) != 0)
+        {
+            throw std::runtime_error("not a snapshot: " + path);
+        }
+
+        return head.header_checksum;
+    }
+
+    inline void write_all(int fd, const char * data, size_t size)
+    {
+        while (size > 0)
+        {
+            ssize_t written = ::write(fd, data, size);
+
+            if (written < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+
+                throw std::runtime_error(std::string("cannot write log: ") + std::strerror(errno));
+            }
+
+            data += written;
+            size -= size_t(written);
+        }
+    }
+} // write_ahead
+
+class WriteAheadLog
+{
+public:
+    // Loads the snapshot at snapshot_path, or starts an empty graph of
+    // vertex_count vertices with seed when there is none, and replays the
+    // log at log_path into it
+    WriteAheadLog(const std::string & log_path, const std::string & snapshot_path, int64_t vertex_count,
+                  uint64_t seed, std::chrono::microseconds commit_delay = std::chrono::milliseconds(1),
+                  size_t commit_bytes = 1 << 20)
+        : m_log_path(log_path), m_snapshot_path(snapshot_path), m_commit_delay(commit_delay),
+        m_commit_bytes(commit_bytes), m_fd(-1), m_replayed(0), m_last_u(0), m_group_records(0),
+        m_appended(0), m_durable(0), m_commit_requested(false), m_stop(false)
+    {
+        uint64_t base = write_ahead::snapshot_id(snapshot_path);
+
+        if (base != 0)
+        {
+            m_graph = DynamicGraph::Load(snapshot_path);
+        }
+        else
+        {
+            m_graph.reset(new DynamicGraph(vertex_count, seed));
+        }
+
+        if (m_graph->VertexCount() != vertex_count)
+        {
+            throw std::runtime_error("snapshot " + snapshot_path + " has another vertex count");
+        }
+
+        size_t valid = replay(base);
+
+        if (valid == 0)
+        {
+            create_log(base);
+        }
+        else
+        {
+            open_log(valid);
+        }
+
+        m_group.assign(sizeof(write_ahead::group_header), 0);
+        m_flusher = std::thread([this]() { flush_groups(); });
+    }
+
+    WriteAheadLog(const WriteAheadLog &) = delete;
+    WriteAheadLog & operator=(const WriteAheadLog &) = delete;
+
+    ~WriteAheadLog()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+
+            m_stop = true;
+        }
+
+        m_wake.notify_one();
+        m_flusher.join();
+
+        ::close(m_fd);
+    }
+
+    // The graph with every update so far, durable or not
+    DynamicGraph & Graph()
+    {
+        return *m_graph;
+    }
+
+    // Updates applied from the log on construction
+    int64_t ReplayedCount() const
+    {
+        return m_replayed;
+    }
+
+    void AddEdge(int64_t u, int64_t v)
+    {
+        StreamUpdate update = { '+', u, v };
+
+        append(&update, 1);
+        m_graph->AddEdge(u, v);
+    }
+
+    void RemoveEdge(int64_t u, int64_t v)
+    {
+        StreamUpdate update = { '-', u, v };
+
+        append(&update, 1);
+        m_graph->RemoveEdge(u, v);
+    }
+
+    // Logs the batch under one lock and applies it with DynamicGraph::ApplyUpdates
+    void ApplyUpdates(const std::vector<EdgeUpdate> & updates)
+    {
+        std::vector<StreamUpdate> records;
+
+        records.reserve(updates.size());
+
+        for (auto & update : updates)
+        {
+            for (int64_t i = 0; i < std::abs(update.delta); ++i)
+            {
+                records.push_back({ update.delta > 0 ? '+' : '-', update.u, update.v });
+            }
+        }
+
+        append(records.data(), records.size());
+        m_graph->ApplyUpdates(updates);
+    }
+
+    // Waits until every update so far is on disk
+    void Commit()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        uint64_t target = m_appended;
+
+        m_commit_requested = true;
+        m_wake.notify_one();
+        m_committed.wait(lock, [this, target]() { return m_durable >= target || !m_error.empty(); });
+
+        if (!m_error.empty())
+        {
+            throw std::runtime_error(m_error);
+        }
+    }
+
+    // Saves the graph as the new snapshot and starts an empty log on it. A
+    // crash at any point leaves either the old snapshot with the whole log
+    // or the new snapshot, with which the old log is not replayed.
+    void Checkpoint()
+    {
+        Commit();
+
+        m_graph->Save(m_snapshot_path);
+
+        // The flusher is idle: everything is committed and updates come
+        // from this thread
+        ::close(m_fd);
+        create_log(write_ahead::snapshot_id(m_snapshot_path));
+    }
+
+    int64_t GetComponentsNumber()
+    {
+        return m_graph->GetComponentsNumber();
+    }
+
+private:
+    // Updates waiting for the flusher stop the writer beyond this many groups
+    static constexpr size_t pending_groups = 4;
+
+    void append(const StreamUpdate * updates, size_t count)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+
+        if (m_group.size() >= pending_groups * m_commit_bytes)
+        {
+            m_committed.wait(lock, [this]() {
+                return m_group.size() < pending_groups * m_commit_bytes || !m_error.empty();
+            });
+        }
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            char record[binary_stream::max_record_size];
+            size_t size = binary_stream::encode(record, updates[i], m_last_u);
+
+            m_group.insert(m_group.end(), record, record + size);
+        }
+
+        m_group_records += count;
+        m_appended += count;
+
+        if (m_group.size() >= m_commit_bytes)
+        {
+            m_wake.notify_one();
+        }
+    }
+
+    // Background thread writing a group whenever it is due
+    void flush_groups()
+    {
+        std::vector<char> group;
+        std::unique_lock<std::mutex> lock(m_mutex);
+
+        for (;;)
+        {
+            m_wake.wait_for(lock, m_commit_delay, [this]() {
+                return m_stop || m_commit_requested || m_group.size() >= m_commit_bytes;
+            });
+
+            m_commit_requested = false;
+
+            if (m_group_records == 0)
+            {
+                if (m_stop)
+                {
+                    return;
+                }
+
+                continue;
+            }
+
+            // Records of a group are coded from u = 0, so groups decode alone
+            group.assign(sizeof(write_ahead::group_header), 0);
+            group.swap(m_group);
+
+            uint64_t records = m_group_records;
+            uint64_t appended = m_appended;
+
+            m_group_records = 0;
+            m_last_u = 0;
+
+            lock.unlock();
+
+            std::string error = m_error.empty() ? write_group(group, records) : std::string();
+
+            lock.lock();
+
+            if (!error.empty())
+            {
+                m_error = error;
+            }
+            else if (m_error.empty())
+            {
+                m_durable = appended;
+            }
+
+            m_committed.notify_all();
+        }
+    }
+
+    // Returns the error, empty on success
+    std::string write_group(std::vector<char> & group, uint64_t records)
+    {
+        write_ahead::group_header head;
+
+        head.payload_size = group.size() - sizeof(head);
+        head.record_count = records;
+
+        group.resize(sizeof(head) + snapshot::round_up(head.payload_size, sizeof(uint64_t)), 0);
+        head.checksum = write_ahead::group_checksum(head, group.data() + sizeof(head));
+        std::memcpy(group.data(), &head, sizeof(head));
+
+        try
+        {
+            write_ahead::write_all(m_fd, group.data(), group.size());
+        }
+        catch (const std::exception & error)
+        {
+            return error.what();
+        }
+
+        if (::fdatasync(m_fd) != 0)
+        {
+            return std::string("cannot sync log: ") + std::strerror(errno);
+        }
+
+        return std::string();
+    }
+
+    // Applies the log if it builds on the snapshot base and returns the size
+    // of its valid part, 0 when there is nothing to keep
+    size_t replay(uint64_t base)
+    {
+        if (::access(m_log_path.c_str(), F_OK) != 0)
+        {
+            return 0;
+        }
+
+        MappedFile log(m_log_path);
+        write_ahead::header head;
+
+        if (log.Size() < sizeof(head))
+        {
+            return 0;
+        }
+
+        std::memcpy(&head, log.Data(), sizeof(head));
+
+        if (std::memcmp(head.magic, write_ahead::magic, sizeof(head.magic)) != 0
+            || head.header_checksum != snapshot::checksum(&head, offsetof(write_ahead::header, header_checksum)
+                                                          / sizeof(uint64_t), 0))
+        {
+            throw std::runtime_error("not a write-ahead log: " + m_log_path);
+        }
+
+        if (head.version != write_ahead::version)
+        {
+            throw std::runtime_error("unsupported write-ahead log version");
+        }
+
+        if (head.vertex_count != m_graph->VertexCount())
+        {
+            throw std::runtime_error("write-ahead log " + m_log_path + " has another vertex count");
+        }
+
+        // A log of an older snapshot is already part of the current one
+        if (head.base != base)
+        {
+            return 0;
+        }
+
+        std::vector<EdgeUpdate> batch;
+        size_t offset = sizeof(head);
+
+        while (log.Size() - offset >= sizeof(write_ahead::group_header))
+        {
+            write_ahead::group_header group;
+
+            std::memcpy(&group, log.Data() + offset, sizeof(group));
+
+            const char * payload = log.Data() + offset + sizeof(group);
+
+            if (group.payload_size > log.Size() - offset - sizeof(group))
+            {
+                break;
+            }
+
+            size_t size = sizeof(group) + snapshot::round_up(group.payload_size, sizeof(uint64_t));
+
+            if (log.Size() - offset < size || group.checksum != write_ahead::group_checksum(group, payload))
+            {
+                break;
+            }
+
+            auto position = reinterpret_cast<const uint8_t *>(payload);
+            auto end = position + group.payload_size;
+            StreamUpdate update;
+            int64_t last_u = 0;
+
+            while (position != end)
+            {
+                binary_stream::decode(position, end, update, last_u);
+
+                // The log holds no queries
+                if (update.op != '?')
+                {
+                    batch.push_back({ update.u, update.v, update.op == '+' ? 1 : -1 });
+                }
+            }
+
+            if (batch.size() >= (1 << 16))
+            {
+                m_graph->ApplyUpdates(batch);
+                batch.clear();
+            }
+
+            m_replayed += group.record_count;
+            offset += size;
+        }
+
+        m_graph->ApplyUpdates(batch);
+
+        return offset;
+    }
+
+    // Replaces the log by an empty one building on the snapshot base
+    void create_log(uint64_t base)
+    {
+        write_ahead::header head;
+
+        std::memset(&head, 0, sizeof(head));
+        std::memcpy(head.magic, write_ahead::magic, sizeof(head.magic));
+
+        head.version = write_ahead::version;
+        head.header_size = sizeof(head);
+        head.vertex_count = m_graph->VertexCount();
+        head.base = base;
+        head.header_checksum = snapshot::checksum(&head, offsetof(write_ahead::header, header_checksum)
+                                                  / sizeof(uint64_t), 0);
+
+        std::string temporary = m_log_path + ".tmp";
+        int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+        if (fd < 0)
+        {
+            throw std::runtime_error("cannot create log " + temporary);
+        }
+
+        try
+        {
+            write_ahead::write_all(fd, reinterpret_cast<const char *>(&head), sizeof(head));
+        }
+        catch (...)
+        {
+            ::close(fd);
+            throw;
+        }
+
+        if (::fdatasync(fd) != 0 || ::close(fd) != 0 || std::rename(temporary.c_str(), m_log_path.c_str()) != 0)
+        {
+            throw std::runtime_error("cannot create log " + m_log_path);
+        }
+
+        snapshot::sync_path(snapshot::directory_of(m_log_path));
+        open_log(sizeof(head));
+    }
+
+    // Opens the log for appending after its first size bytes
+    void open_log(size_t size)
+    {
+        m_fd = ::open(m_log_path.c_str(), O_WRONLY | O_APPEND);
+
+        if (m_fd < 0 || ::ftruncate(m_fd, off_t(size)) != 0 || ::fdatasync(m_fd) != 0)
+        {
+            throw std::runtime_error("cannot open log " + m_log_path);
+        }
+    }
+
+private:
+    const std::string m_log_path;
+    const std::string m_snapshot_path;
+    const std::chrono::microseconds m_commit_delay;
+    const size_t m_commit_bytes;
+
+    std::unique_ptr<DynamicGraph> m_graph;
+    int m_fd;
+    int64_t m_replayed;
+
+    // Guarded by m_mutex: the group being collected, its coding state and
+    // the counts of updates appended and on disk
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::condition_variable m_committed;
+    std::vector<char> m_group;
+    int64_t m_last_u;
+    uint64_t m_group_records;
+    uint64_t m_appended;
+    uint64_t m_durable;
+    bool m_commit_requested;
+    bool m_stop;
+    std::string m_error;
+
+    std::thread m_flusher;
+};